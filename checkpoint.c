@@ -0,0 +1,300 @@
+/*      checkpoint.c
+ *
+ *	Copyright 2015 Bob Parker <rlp1938@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *	MA 02110-1301, USA.
+*/
+
+/*
+ * The checkpoint journal is a text file, only ever appended to:
+ *
+ *   oldfiles-checkpoint 1 <cutoff>
+ *   M <tally> <uid> <gid> <size> <inode> <mtime> <path>
+ *   D <path>      all files directly in path are done, the M records
+ *                 since the previous D/S record belong to it.
+ *   S <path>      path and everything under it is done.
+ *
+ * Records are batched in memory and written with one write() then
+ * fdatasync() every CPSYNCBYTES or CPSYNCSECS, so whatever is on disk is
+ * always a run of whole directories, apart from a possibly torn tail
+ * which the loader ignores and a resume cuts off.
+*/
+
+#include "checkpoint.h"
+#include "fileutil.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define CPSYNCBYTES (1024 * 1024)
+#define CPSYNCSECS 10
+#define CPHASH 65536
+
+static const char *cpmagic = "oldfiles-checkpoint 1";
+
+struct cpname {
+	char *name;
+	struct cpname *next;
+};
+
+static int cpfd = -1;
+static struct cpbuf cpout;
+static time_t cplastsync;
+static pthread_mutex_t cplock = PTHREAD_MUTEX_INITIALIZER;
+static struct cpname *dirsdone[CPHASH];
+static struct cpname *treesdone[CPHASH];
+
+static void cpappend(struct cpbuf *cb, const char *fmt, ...);
+static void cpwrite(void);
+static unsigned cphash(const char *s);
+static void cpremember(struct cpname **set, const char *name);
+static int cpknown(struct cpname **set, const char *name);
+static off_t cpload(const char *filename, time_t *cutoff,
+			void (*replay)(const char *path, const struct stat *sb,
+							int tally));
+
+void cpopen(const char *filename, int resume, time_t *cutoff,
+			void (*replay)(const char *path, const struct stat *sb,
+							int tally))
+{	/* Start a journal, or with resume carry on with an existing one.
+	 * On resume the journal's cutoff replaces *cutoff so the rest of
+	 * the scan selects on the same date as the part already done. */
+	int flags = O_WRONLY | O_CREAT;
+	off_t whole = 0;
+
+	if (resume && access(filename, F_OK) == 0) {
+		whole = cpload(filename, cutoff, replay);
+		flags |= O_APPEND;
+	} else {
+		resume = 0;
+		flags |= O_TRUNC;
+	}
+	cpfd = open(filename, flags, 0644);
+	if (cpfd == -1) {
+		perror(filename);
+		exit(EXIT_FAILURE);
+	}
+	/* drop matches whose D never made it and any torn last line, so
+	 * they aren't counted under the next directory finished */
+	if (resume && ftruncate(cpfd, whole) == -1) {
+		perror(filename);
+		exit(EXIT_FAILURE);
+	}
+	if (!(resume)) {
+		pthread_mutex_lock(&cplock);
+		cpappend(&cpout, "%s %ld\n", cpmagic, (long)*cutoff);
+		cpwrite();
+		pthread_mutex_unlock(&cplock);
+	}
+	cplastsync = time(NULL);
+	atexit(cpflush);	// keep what we have if a fatal error exits
+} // cpopen()
+
+void cpaddmatch(struct cpbuf *cb, const char *path,
+				const struct stat *sb, int tally)
+{
+	cpappend(cb, "M %d %lu %lu %lld %lx %ld %s\n", tally,
+				(unsigned long)sb->st_uid, (unsigned long)sb->st_gid,
+				(long long)sb->st_size, (unsigned long)sb->st_ino,
+				(long)sb->st_mtime, path);
+} // cpaddmatch()
+
+void cpcommit(struct cpbuf *cb, const char *dirname)
+{	// journal the matches of dirname and mark it done.
+	pthread_mutex_lock(&cplock);
+	if (cb->len) {
+		cpappend(&cpout, "%s", cb->buf);
+		cb->len = 0;
+	}
+	cpappend(&cpout, "D %s\n", dirname);
+	if (cpout.len >= CPSYNCBYTES || time(NULL) - cplastsync >= CPSYNCSECS) {
+		cpwrite();
+	}
+	pthread_mutex_unlock(&cplock);
+} // cpcommit()
+
+void cpsubtree(const char *dirname)
+{
+	pthread_mutex_lock(&cplock);
+	cpappend(&cpout, "S %s\n", dirname);
+	pthread_mutex_unlock(&cplock);
+} // cpsubtree()
+
+void cpflush(void)
+{
+	if (cpfd == -1) return;
+	pthread_mutex_lock(&cplock);
+	cpwrite();
+	pthread_mutex_unlock(&cplock);
+} // cpflush()
+
+int cpdirdone(const char *dirname)
+{
+	return cpknown(dirsdone, dirname);
+} // cpdirdone()
+
+int cpsubtreedone(const char *dirname)
+{
+	return cpknown(treesdone, dirname);
+} // cpsubtreedone()
+
+void cpwrite(void)
+{	/* write out and sync the pending records, caller holds cplock.
+	 * On failure cpfd is dropped before exit() so the cpflush() exit
+	 * handler doesn't wait on the lock held here. */
+	char *from = cpout.buf;
+	ssize_t written;
+
+	while (cpout.len) {
+		written = write(cpfd, from, cpout.len);
+		if (written == -1) {
+			if (errno == EINTR) continue;
+			perror("checkpoint write()");
+			cpfd = -1;
+			exit(EXIT_FAILURE);
+		}
+		from += written;
+		cpout.len -= written;
+	}
+	if (fdatasync(cpfd) == -1) {
+		perror("checkpoint fdatasync()");
+		cpfd = -1;
+		exit(EXIT_FAILURE);
+	}
+	cplastsync = time(NULL);
+} // cpwrite()
+
+void cpappend(struct cpbuf *cb, const char *fmt, ...)
+{	// printf onto the end of cb, growing it as needed.
+	va_list ap;
+	int need;
+
+	for (;;) {
+		va_start(ap, fmt);
+		need = vsnprintf(cb->buf + cb->len, cb->size - cb->len, fmt, ap);
+		va_end(ap);
+		if (cb->len + need < cb->size) break;
+		cb->size = (cb->size + need + 1) * 2;
+		cb->buf = realloc(cb->buf, cb->size);
+		if (!(cb->buf)) {
+			perror("realloc()");
+			exit(EXIT_FAILURE);
+		}
+	}
+	cb->len += need;
+} // cpappend()
+
+off_t cpload(const char *filename, time_t *cutoff,
+			void (*replay)(const char *path, const struct stat *sb,
+							int tally))
+{	/* Read back a journal. M records are only replayed once the D
+	 * record that closes their directory is seen, anything after the
+	 * last D is from a directory that will be scanned again. Returns
+	 * the length of the journal up to its last D or S record, the rest
+	 * is to be dropped before appending. */
+	struct fdata fdat;
+	char *bol, *eol, *held, *keep;
+	long cut;
+	int pos;
+
+	fdat = readfile(filename, 1, 1);
+	eol = memchr(fdat.from, '\n', fdat.to - fdat.from);
+	if (!(eol) || sscanf(fdat.from, "oldfiles-checkpoint 1 %ld", &cut) != 1) {
+		fprintf(stderr, "%s is not an oldfiles checkpoint\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	*cutoff = cut;
+	held = keep = eol + 1;
+	for (bol = eol + 1; bol < fdat.to; bol = eol + 1) {
+		eol = memchr(bol, '\n', fdat.to - bol);
+		if (!(eol)) break;	// torn last line
+		*eol = '\0';
+		switch (bol[0]) {
+			case 'D':
+			// replay the matches belonging to this dir
+			while (held < bol) {
+				struct stat sb;
+				unsigned long uid, gid, ino;
+				long long size;
+				long mtime;
+				int tally;
+
+				memset(&sb, 0, sizeof(sb));
+				if (sscanf(held, "M %d %lu %lu %lld %lx %ld %n", &tally,
+							&uid, &gid, &size, &ino, &mtime, &pos) == 6) {
+					sb.st_uid = uid;
+					sb.st_gid = gid;
+					sb.st_size = size;
+					sb.st_ino = ino;
+					sb.st_mtime = mtime;
+					replay(held + pos, &sb, tally);
+				}
+				held += strlen(held) + 1;
+			}
+			cpremember(dirsdone, bol + 2);
+			held = keep = eol + 1;
+			break;
+			case 'S':
+			cpremember(treesdone, bol + 2);
+			if (held == bol) held = eol + 1;
+			keep = eol + 1;
+			break;
+		}
+	} // for()
+	// the file buffer is kept, the name sets point into it.
+	return keep - fdat.from;
+} // cpload()
+
+unsigned cphash(const char *s)
+{	// FNV-1a
+	unsigned h = 2166136261u;
+
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+	return h % CPHASH;
+} // cphash()
+
+void cpremember(struct cpname **set, const char *name)
+{
+	struct cpname *cn = malloc(sizeof(struct cpname));
+	unsigned h = cphash(name);
+
+	if (!(cn)) {
+		perror("malloc()");
+		exit(EXIT_FAILURE);
+	}
+	cn->name = (char *)name;
+	cn->next = set[h];
+	set[h] = cn;
+} // cpremember()
+
+int cpknown(struct cpname **set, const char *name)
+{
+	struct cpname *cn;
+
+	for (cn = set[cphash(name)]; cn; cn = cn->next) {
+		if (strcmp(cn->name, name) == 0) return 1;
+	}
+	return 0;
+} // cpknown()
@@ -0,0 +1,27 @@
+#ifndef _CHECKPOINT_H
+#define _CHECKPOINT_H 1
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/* Matches found in one directory, held back until the directory is
+ * finished so they reach the journal together with its D record. */
+struct cpbuf {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+void cpopen(const char *filename, int resume, time_t *cutoff,
+			void (*replay)(const char *path, const struct stat *sb,
+							int tally));
+void cpaddmatch(struct cpbuf *cb, const char *path,
+				const struct stat *sb, int tally);
+void cpcommit(struct cpbuf *cb, const char *dirname);
+void cpsubtree(const char *dirname);
+void cpflush(void);
+int cpdirdone(const char *dirname);
+int cpsubtreedone(const char *dirname);
+
+#endif /* checkpoint.h */
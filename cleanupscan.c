@@ -0,0 +1,378 @@
+/*      cleanupscan.c
+ *
+ *  Copyright 2015 Bob Parker rlp1938@gmail.com
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include "fileutil.h"
+#include "scan.h"
+#include "timeutil.h"
+#include "throttle.h"
+
+static char *helpmsg =
+  "NAME\n\tcleanupscan - the oldfiles, bigfiles, brokensym and duplicates"
+  "\n\tsearches done in one pass over the file system.\n"
+  "SYNOPSIS"
+  "\n\tcleanupscan [option] [topdir ...]\n"
+  "\n\tWrites the reports oldfiles, bigfiles, brokensym and dupsizes\n"
+  "\tto the report directory, by default the current directory.\n"
+  "\tBy default topdir is the user's home directory.\n"
+  "\nDESCRIPTION\n"
+  "\tEach file under topdir is read and stat'ed once and offered to\n"
+  "\tevery report. oldfiles lists files older than the cut off in the\n"
+  "\tsame form as oldfiles(1), bigfiles lists files of at least the\n"
+  "\tminimum size largest first, brokensym lists broken symlinks and\n"
+  "\tdupsizes lists files whose size is shared by another file, the\n"
+  "\tonly ones that need to be checksummed when looking for duplicates.\n"
+  "\nOPTIONS\n"
+  "\t-h outputs this help message.\n"
+  "\t-aN[MmDd] Age of old files, by default 3 years.\n"
+  "\t-o yyyymmdd[hh[mm]] Old files are older than this date.\n"
+  "\t-s N[KkMm] Minimum size for bigfiles, in bytes unless followed\n"
+  "\t by K or M. Default 1 byte.\n"
+  "\t-d dir Write the reports in dir.\n"
+  "\t-q Quiet mode, no summary of what was found.\n"
+  "\t-j, --jobs N Use N worker threads per device, default 1.\n"
+  "\t-J, --device-jobs path=N Use N worker threads for the device\n"
+  "\t holding path, overriding -j. May be repeated.\n"
+  "\t-m, --max-stats-per-sec N Do no more than N stat()s a second.\n"
+  "\t-A, --adaptive Slow down while the disks are busy.\n"
+;
+
+/* One report, fed by its own visitor. Workers append to the raw file
+ * under the report's lock and it is sorted into shape at the end. */
+struct report {
+	const char *name;
+	char raw[PATH_MAX];
+	FILE *fp;
+	long count;
+	pthread_mutex_t lock;
+};
+
+static time_t fileage;
+static off_t minsize;
+static const char *pathend = "!*END*!";
+static struct report oldrep = { "oldfiles", "", NULL, 0,
+								PTHREAD_MUTEX_INITIALIZER };
+static struct report bigrep = { "bigfiles", "", NULL, 0,
+								PTHREAD_MUTEX_INITIALIZER };
+static struct report brokenrep = { "brokensym", "", NULL, 0,
+								PTHREAD_MUTEX_INITIALIZER };
+static struct report duprep = { "dupsizes", "", NULL, 0,
+								PTHREAD_MUTEX_INITIALIZER };
+
+static void dohelp(int forced);
+static void visitold(const struct scanentry *e, void *dirdata, void *ctx);
+static void visitbig(const struct scanentry *e, void *dirdata, void *ctx);
+static void visitbroken(const struct scanentry *e, void *dirdata,
+						void *ctx);
+static void visitdup(const struct scanentry *e, void *dirdata, void *ctx);
+static void openreport(struct report *rep, const char *dir);
+static void finishreport(struct report *rep, const char *dir);
+static void keepdupsizes(const char *in, const char *out);
+static void writerun(char *from, char *to, FILE *fpo);
+
+static struct scanvisitor oldvisitor = {
+	STATX_MTIME | STATX_INO, NULL, visitold, NULL, NULL, &oldrep
+};
+static struct scanvisitor bigvisitor = {
+	STATX_SIZE, NULL, visitbig, NULL, NULL, &bigrep
+};
+static struct scanvisitor brokenvisitor = {
+	STATX_TYPE, NULL, visitbroken, NULL, NULL, &brokenrep
+};
+static struct scanvisitor dupvisitor = {
+	STATX_SIZE | STATX_NLINK | STATX_INO, NULL, visitdup, NULL, NULL,
+	&duprep
+};
+
+int main(int argc, char **argv)
+{
+	int opt, age, quiet, adaptive, jobs, i;
+	double maxrate;
+	char aunit = 'Y';
+	char *repdir = ".";
+	char *end;
+	static struct option long_options[] = {
+		{"help",		no_argument,		0,	'h'},
+		{"jobs",		required_argument,	0,	'j'},
+		{"device-jobs",	required_argument,	0,	'J'},
+		{"max-stats-per-sec",	required_argument,	0,	'm'},
+		{"adaptive",	no_argument,		0,	'A'},
+		{0,	0,	0,	0}
+	};
+
+	// set up defaults
+	quiet = 0;
+	adaptive = 0;
+	maxrate = 0.0;
+	age = 3;
+	fileage = 0;
+	minsize = 1;
+
+	while((opt = getopt_long(argc, argv, ":ha:o:s:d:qj:J:m:A",
+								long_options, NULL)) != -1) {
+		switch(opt){
+		case 'h':
+			dohelp(0);
+		break;
+		case 'a': // change default age
+			age = strtol(optarg, NULL, 10);
+			if (strchr(optarg, 'M')) aunit = 'M';
+			if (strchr(optarg, 'm')) aunit = 'M';
+			if (strchr(optarg, 'D')) aunit = 'D';
+			if (strchr(optarg, 'd')) aunit = 'D';
+		break;
+		case 'o':   // old means older than this date
+			fileage = parsetimestring(optarg);
+			if (fileage == (time_t)-1) dohelp(1);
+		break;
+		case 's':	// smallest big file
+			minsize = strtoll(optarg, &end, 10);
+			if (*end == 'K' || *end == 'k') minsize *= 1024;
+			if (*end == 'M' || *end == 'm') minsize *= 1024 * 1024;
+		break;
+		case 'd':	// reports go here
+			repdir = optarg;
+		break;
+		case 'q':
+			quiet = 1;
+		break;
+		case 'j':	// workers per device
+			jobs = strtol(optarg, NULL, 10);
+			if (jobs < 1) {
+				fprintf(stderr, "Illegal value for jobs: %s\n", optarg);
+				dohelp(1);
+			}
+			scansetjobs(jobs);
+		break;
+		case 'J':	// workers for one particular device
+			scandevlimit(optarg);
+		break;
+		case 'm':	// cap the stat rate
+			maxrate = strtod(optarg, NULL);
+			if (maxrate <= 0) {
+				fprintf(stderr, "Illegal value for stats per second: %s\n",
+							optarg);
+				dohelp(1);
+			}
+		break;
+		case 'A':	// back off when the disks are busy
+			adaptive = 1;
+		break;
+		case ':':
+			fprintf(stderr, "Option %c requires an argument\n",optopt);
+			dohelp(1);
+		break;
+		case '?':
+			fprintf(stderr, "Illegal option: %c\n",optopt);
+			dohelp(1);
+		break;
+		} //switch()
+	}//while()
+
+	if (argc > optind) {
+		for (i = optind; i < argc; i++) scanaddroot(argv[i]);
+	} else {
+		scanaddroot(getenv("HOME"));
+	}
+	if (!(fileage)) fileage = cutofftimebyage(age, aunit);
+
+	openreport(&oldrep, repdir);
+	openreport(&bigrep, repdir);
+	openreport(&brokenrep, repdir);
+	openreport(&duprep, repdir);
+	scanaddvisitor(&oldvisitor);
+	scanaddvisitor(&bigvisitor);
+	scanaddvisitor(&brokenvisitor);
+	scanaddvisitor(&dupvisitor);
+	throttleinit(maxrate, adaptive);
+	scanrun();
+	finishreport(&oldrep, repdir);
+	finishreport(&bigrep, repdir);
+	finishreport(&brokenrep, repdir);
+	finishreport(&duprep, repdir);
+
+	if (!(quiet)) {
+		fprintf(stderr, "%ld old, %ld big, %ld broken symlinks, %ld"
+					" files sharing a size. Reports are in %s\n",
+					oldrep.count, bigrep.count, brokenrep.count,
+					duprep.count, repdir);
+	}
+	return 0;
+}//main()
+
+void dohelp(int forced)
+{
+  fputs(helpmsg, stderr);
+  exit(forced);
+}
+
+void visitold(const struct scanentry *e, void *dirdata, void *ctx)
+{	// as oldfiles(1), a symlink reports both itself and its target.
+	struct report *rep = ctx;
+	struct tm tm;
+	char when[32];
+	char target[PATH_MAX];
+	time_t mtime;
+
+	(void)dirdata;
+	if (e->type != DT_REG && e->type != DT_LNK) return;
+	if (!(e->stx)) return;
+	mtime = e->stx->stx_mtime.tv_sec;
+	if (mtime >= fileage) return;
+	if (e->type == DT_LNK && !(realpath(e->path, target))) return;
+	localtime_r(&mtime, &tm);
+	asctime_r(&tm, when);
+	pthread_mutex_lock(&rep->lock);
+	fprintf(rep->fp, "%.16lx %s%s %s", (unsigned long)e->stx->stx_ino,
+				e->path, pathend, when);
+	if (e->type == DT_LNK) {
+		fprintf(rep->fp, "%.16lx %s%s %s", (unsigned long)e->stx->stx_ino,
+					target, pathend, when);
+	}
+	rep->count++;
+	pthread_mutex_unlock(&rep->lock);
+} // visitold()
+
+void visitbig(const struct scanentry *e, void *dirdata, void *ctx)
+{
+	struct report *rep = ctx;
+
+	(void)dirdata;
+	if (e->type != DT_REG || !(e->stx)) return;
+	if ((off_t)e->stx->stx_size < minsize) return;
+	pthread_mutex_lock(&rep->lock);
+	fprintf(rep->fp, "%lld %s\n", (long long)e->stx->stx_size, e->path);
+	rep->count++;
+	pthread_mutex_unlock(&rep->lock);
+} // visitbig()
+
+void visitbroken(const struct scanentry *e, void *dirdata, void *ctx)
+{	// a link that can't be followed, missing target or circular.
+	struct report *rep = ctx;
+
+	(void)dirdata;
+	if (e->type != DT_LNK || !(e->staterr)) return;
+	pthread_mutex_lock(&rep->lock);
+	fprintf(rep->fp, "%s\n", e->path);
+	rep->count++;
+	pthread_mutex_unlock(&rep->lock);
+} // visitbroken()
+
+void visitdup(const struct scanentry *e, void *dirdata, void *ctx)
+{	// every non empty file, bucketed by size once sorted.
+	struct report *rep = ctx;
+
+	(void)dirdata;
+	if (e->type != DT_REG || !(e->stx) || !(e->stx->stx_size)) return;
+	if (e->linkseen) return;	// another name for a file, not a copy
+	pthread_mutex_lock(&rep->lock);
+	fprintf(rep->fp, "%020lld %s\n", (long long)e->stx->stx_size, e->path);
+	pthread_mutex_unlock(&rep->lock);
+} // visitdup()
+
+void openreport(struct report *rep, const char *dir)
+{
+	sprintf(rep->raw, "%s/%s.raw", dir, rep->name);
+	rep->fp = dofopen(rep->raw, "w");
+	setvbuf(rep->fp, NULL, _IOFBF, 65536);
+} // openreport()
+
+void finishreport(struct report *rep, const char *dir)
+{	// sort the raw report into its final form.
+	char out[PATH_MAX], tmp1[PATH_MAX + 2], tmp2[PATH_MAX + 2];
+	char command[3 * PATH_MAX];
+
+	fclose(rep->fp);
+	sprintf(out, "%s/%s", dir, rep->name);
+	sprintf(tmp1, "%s.1", out);
+	sprintf(tmp2, "%s.2", out);
+	if (rep == &oldrep) {
+		sortlist(rep->raw, tmp1, tmp2, out);
+	} else if (rep == &bigrep) {
+		sprintf(command, "sort -rn '%s' > '%s'", rep->raw, out);
+		dosystem(command);
+	} else if (rep == &brokenrep) {
+		sprintf(command, "sort -u '%s' > '%s'", rep->raw, out);
+		dosystem(command);
+	} else {
+		sprintf(command, "sort '%s' > '%s'", rep->raw, tmp1);
+		dosystem(command);
+		keepdupsizes(tmp1, out);
+	}
+	unlink(rep->raw);
+	unlink(tmp1);
+	unlink(tmp2);
+} // finishreport()
+
+void keepdupsizes(const char *in, const char *out)
+{	/* in is sorted on the zero padded size, keep only the runs of two
+	 * or more files of one size, each run followed by a blank line. */
+	struct fdata fdat;
+	FILE *fpo;
+	char *bol, *eol, *runstart;
+	int runlen;
+
+	fdat = readfile(in, 0, 1);
+	fpo = dofopen(out, "w");
+	runstart = bol = fdat.from;
+	runlen = 0;
+	while (bol < fdat.to) {
+		eol = memchr(bol, '\n', fdat.to - bol);
+		if (!(eol)) break;
+		if (runlen && memcmp(bol, runstart, 20) != 0) {
+			if (runlen > 1) {
+				writerun(runstart, bol, fpo);
+				fputc('\n', fpo);
+				duprep.count += runlen;
+			}
+			runstart = bol;
+			runlen = 0;
+		}
+		runlen++;
+		bol = eol + 1;
+	}
+	if (runlen > 1) {
+		writerun(runstart, bol, fpo);
+		duprep.count += runlen;
+	}
+	fclose(fpo);
+	free(fdat.from);
+} // keepdupsizes()
+
+void writerun(char *from, char *to, FILE *fpo)
+{	// write lines from..to without the zero padding on the size.
+	char *eol;
+
+	while (from < to) {
+		eol = memchr(from, '\n', to - from);
+		fprintf(fpo, "%lld", strtoll(from, NULL, 10));
+		fwrite(from + 20, 1, eol - from - 19, fpo);
+		from = eol + 1;
+	}
+} // writerun()
@@ -0,0 +1,324 @@
+/*      compress.c
+ *
+ *	Copyright 2015 Bob Parker <rlp1938@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *	MA 02110-1301, USA.
+*/
+
+/*
+ * Compressed output for very long listings. Output is cut into
+ * CWBLOCK sized blocks and each is compressed on its own by a pool of
+ * workers, as a complete gzip member or zstd frame. Both formats allow
+ * members or frames to be concatenated, so a block can be written and
+ * flushed as soon as it and every block before it are ready and a
+ * reader at the other end of a pipe can decompress as it arrives.
+*/
+
+#include "config.h"
+#include "compress.h"
+#include "fileutil.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+#define CWBLOCK (1024 * 1024)
+#define CWGZIP 1
+#define CWZSTD 2
+
+struct cwblock {
+	char *in;
+	size_t inlen;
+	char *out;
+	size_t outlen;
+	int done;	// compressed and ready to write
+};
+
+struct cwriter {
+	FILE *out;
+	int method;
+	int nworkers;
+	pthread_t *worker;
+	pthread_t writer;
+	int nslots;	// blocks in flight, a ring
+	struct cwblock *slot;
+	unsigned long filled;	// blocks handed to the workers so far
+	unsigned long taken;	// blocks a worker has started on
+	unsigned long written;	// blocks written out
+	char *cur;	// block being filled
+	size_t curlen;
+	int closing;
+	pthread_mutex_t lock;
+	pthread_cond_t work;	// a block to compress, or closing
+	pthread_cond_t ready;	// a block was compressed
+	pthread_cond_t space;	// a slot came free
+};
+
+static void *cwworker(void *arg);
+static void *cwwriter(void *arg);
+static void cwsubmit(struct cwriter *cw);
+static void cwcompress(struct cwriter *cw, struct cwblock *b);
+
+int cwmethod(const char *method)
+{	// method is "gzip" or "zstd", NULL for the best built in.
+	if (!(method)) {
+#ifdef HAVE_LIBZSTD
+		method = "zstd";
+#else
+		method = "gzip";
+#endif
+	}
+	if (strcmp(method, "gzip") == 0) {
+#ifndef HAVE_LIBZ
+		fprintf(stderr, "Built without gzip support\n");
+		exit(EXIT_FAILURE);
+#endif
+		return CWGZIP;
+	}
+	if (strcmp(method, "zstd") == 0) {
+#ifndef HAVE_LIBZSTD
+		fprintf(stderr, "Built without zstd support\n");
+		exit(EXIT_FAILURE);
+#endif
+		return CWZSTD;
+	}
+	fprintf(stderr, "Unknown compression: %s\n", method);
+	exit(EXIT_FAILURE);
+} // cwmethod()
+
+struct cwriter *cwopen(FILE *out, const char *method, int workers)
+{
+	struct cwriter *cw = domalloc(sizeof(struct cwriter));
+	int i;
+
+	memset(cw, 0, sizeof(struct cwriter));
+	cw->method = cwmethod(method);
+	cw->out = out;
+	cw->nworkers = workers;
+	cw->nslots = 2 * workers;
+	cw->slot = domalloc(sizeof(struct cwblock) * cw->nslots);
+	memset(cw->slot, 0, sizeof(struct cwblock) * cw->nslots);
+	cw->cur = domalloc(CWBLOCK);
+	pthread_mutex_init(&cw->lock, NULL);
+	pthread_cond_init(&cw->work, NULL);
+	pthread_cond_init(&cw->ready, NULL);
+	pthread_cond_init(&cw->space, NULL);
+	cw->worker = domalloc(sizeof(pthread_t) * workers);
+	for (i = 0; i < workers; i++) {
+		errno = pthread_create(&cw->worker[i], NULL, cwworker, cw);
+		if (errno) {
+			perror("pthread_create()");
+			exit(EXIT_FAILURE);
+		}
+	}
+	errno = pthread_create(&cw->writer, NULL, cwwriter, cw);
+	if (errno) {
+		perror("pthread_create()");
+		exit(EXIT_FAILURE);
+	}
+	return cw;
+} // cwopen()
+
+void cwwrite(struct cwriter *cw, const void *buf, size_t len)
+{
+	const char *from = buf;
+	size_t n;
+
+	while (len) {
+		n = CWBLOCK - cw->curlen;
+		if (n > len) n = len;
+		memcpy(cw->cur + cw->curlen, from, n);
+		cw->curlen += n;
+		from += n;
+		len -= n;
+		if (cw->curlen == CWBLOCK) cwsubmit(cw);
+	}
+} // cwwrite()
+
+void cwclose(struct cwriter *cw)
+{	// compress what is left, wait for it all to be written.
+	int i;
+
+	if (cw->curlen) cwsubmit(cw);
+	pthread_mutex_lock(&cw->lock);
+	cw->closing = 1;
+	pthread_cond_broadcast(&cw->work);
+	pthread_cond_broadcast(&cw->ready);
+	pthread_mutex_unlock(&cw->lock);
+	for (i = 0; i < cw->nworkers; i++) pthread_join(cw->worker[i], NULL);
+	pthread_join(cw->writer, NULL);
+	fflush(cw->out);
+	for (i = 0; i < cw->nslots; i++) {
+		free(cw->slot[i].in);
+		free(cw->slot[i].out);
+	}
+	free(cw->slot);
+	free(cw->worker);
+	free(cw->cur);
+	free(cw);
+} // cwclose()
+
+void cwdumpfile(const char *dumpthis, struct cwriter *cw)
+{	// as dumpfile() but a block at a time, the file may be huge.
+	FILE *fpi = dofopen(dumpthis, "r");
+	char *buf = domalloc(CWBLOCK);
+	size_t n;
+
+	while ((n = fread(buf, 1, CWBLOCK, fpi)) > 0) cwwrite(cw, buf, n);
+	if (ferror(fpi)) {
+		perror(dumpthis);
+		exit(EXIT_FAILURE);
+	}
+	fclose(fpi);
+	free(buf);
+} // cwdumpfile()
+
+void cwsubmit(struct cwriter *cw)
+{	// hand the current block to the workers, waiting for a free slot.
+	struct cwblock *b;
+	char *swap;
+
+	pthread_mutex_lock(&cw->lock);
+	while (cw->filled - cw->written >= (unsigned long)cw->nslots) {
+		pthread_cond_wait(&cw->space, &cw->lock);
+	}
+	b = &cw->slot[cw->filled % cw->nslots];
+	// swap buffers so the slot's old input buffer is reused
+	swap = b->in;
+	b->in = cw->cur;
+	b->inlen = cw->curlen;
+	b->done = 0;
+	cw->cur = swap ? swap : domalloc(CWBLOCK);
+	cw->curlen = 0;
+	cw->filled++;
+	pthread_cond_signal(&cw->work);
+	pthread_mutex_unlock(&cw->lock);
+} // cwsubmit()
+
+void *cwworker(void *arg)
+{
+	struct cwriter *cw = arg;
+	struct cwblock *b;
+
+	pthread_mutex_lock(&cw->lock);
+	for (;;) {
+		while (cw->taken == cw->filled && !(cw->closing)) {
+			pthread_cond_wait(&cw->work, &cw->lock);
+		}
+		if (cw->taken == cw->filled) break;	// closing, nothing left
+		b = &cw->slot[cw->taken % cw->nslots];
+		cw->taken++;
+		pthread_mutex_unlock(&cw->lock);
+
+		cwcompress(cw, b);
+
+		pthread_mutex_lock(&cw->lock);
+		b->done = 1;
+		pthread_cond_broadcast(&cw->ready);
+	}
+	pthread_mutex_unlock(&cw->lock);
+	return NULL;
+} // cwworker()
+
+void *cwwriter(void *arg)
+{	// write the blocks out in order as each becomes ready.
+	struct cwriter *cw = arg;
+	struct cwblock *b;
+
+	pthread_mutex_lock(&cw->lock);
+	for (;;) {
+		b = &cw->slot[cw->written % cw->nslots];
+		while (!(cw->written < cw->filled && b->done) &&
+				!(cw->closing && cw->written == cw->filled)) {
+			pthread_cond_wait(&cw->ready, &cw->lock);
+		}
+		if (cw->written == cw->filled) break;	// closing, all written
+		pthread_mutex_unlock(&cw->lock);
+
+		if (fwrite(b->out, 1, b->outlen, cw->out) != b->outlen ||
+				fflush(cw->out) == EOF) {
+			perror("compressed output");
+			exit(EXIT_FAILURE);
+		}
+
+		pthread_mutex_lock(&cw->lock);
+		b->done = 0;
+		cw->written++;
+		pthread_cond_signal(&cw->space);
+	}
+	pthread_mutex_unlock(&cw->lock);
+	return NULL;
+} // cwwriter()
+
+void cwcompress(struct cwriter *cw, struct cwblock *b)
+{	// make b->in into one self contained gzip member or zstd frame.
+	size_t bound = 0;
+
+#ifdef HAVE_LIBZ
+	if (cw->method == CWGZIP) {
+		z_stream zs;
+
+		memset(&zs, 0, sizeof(zs));
+		// windowBits 15 + 16 asks for a gzip header and trailer
+		if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16,
+							8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			fprintf(stderr, "deflateInit2() failed\n");
+			exit(EXIT_FAILURE);
+		}
+		bound = deflateBound(&zs, b->inlen);
+		b->out = realloc(b->out, bound);
+		if (!(b->out)) {
+			perror("realloc()");
+			exit(EXIT_FAILURE);
+		}
+		zs.next_in = (Bytef *)b->in;
+		zs.avail_in = b->inlen;
+		zs.next_out = (Bytef *)b->out;
+		zs.avail_out = bound;
+		if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+			fprintf(stderr, "deflate() failed\n");
+			exit(EXIT_FAILURE);
+		}
+		b->outlen = zs.total_out;
+		deflateEnd(&zs);
+	}
+#endif
+#ifdef HAVE_LIBZSTD
+	if (cw->method == CWZSTD) {
+		bound = ZSTD_compressBound(b->inlen);
+		b->out = realloc(b->out, bound);
+		if (!(b->out)) {
+			perror("realloc()");
+			exit(EXIT_FAILURE);
+		}
+		b->outlen = ZSTD_compress(b->out, bound, b->in, b->inlen, 3);
+		if (ZSTD_isError(b->outlen)) {
+			fprintf(stderr, "ZSTD_compress(): %s\n",
+						ZSTD_getErrorName(b->outlen));
+			exit(EXIT_FAILURE);
+		}
+	}
+#endif
+	(void)bound;
+} // cwcompress()
@@ -0,0 +1,14 @@
+#ifndef _COMPRESS_H
+#define _COMPRESS_H 1
+
+#include <stdio.h>
+
+struct cwriter;
+
+int cwmethod(const char *method);
+struct cwriter *cwopen(FILE *out, const char *method, int workers);
+void cwwrite(struct cwriter *cw, const void *buf, size_t len);
+void cwclose(struct cwriter *cw);
+void cwdumpfile(const char *dumpthis, struct cwriter *cw);
+
+#endif /* compress.h */
@@ -22,6 +22,8 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <sys/wait.h>
 
 struct fdata readfile(const char *filename, off_t extra, int fatal)
 {
@@ -87,3 +89,82 @@ void dumpfile(const char *dumpthis, FILE *dumpto)
 	fwrite(fdat.from, 1, fdat.to - fdat.from, dumpto);
 	free (fdat.from);
 } // dumpfile()
+
+void *domalloc(size_t thesize)
+{	// malloc() with error handling
+	void *ptr = malloc(thesize);
+	if (!(ptr)) {
+		perror("malloc()");
+		exit(EXIT_FAILURE);
+	}
+	return ptr;
+} // domalloc()
+
+char *dostrdup(const char *s)
+{
+	/*
+	 * strdup() with in built error handling
+	*/
+	char *cp = strdup(s);
+	if(!(cp)) {
+		perror(s);
+		exit(EXIT_FAILURE);
+	}
+	return cp;
+} // dostrdup()
+
+void dorealpath(const char *givenpath, char *resolvedpath)
+{	// realpath() witherror handling.
+	if(!(realpath(givenpath, resolvedpath))) {
+		perror("realpath()");
+		exit(EXIT_FAILURE);
+	}
+} // dorealpath()
+
+void dosystem(const char *cmd)
+{
+    const int status = system(cmd);
+
+    if (status == -1) {
+        fprintf(stderr, "system to execute: %s\n", cmd);
+        exit(EXIT_FAILURE);
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        fprintf(stderr, "%s failed with non-zero exit\n", cmd);
+        exit(EXIT_FAILURE);
+    }
+
+    return;
+} // dosystem()
+
+void stripinode(const char *fnamein, const char *fnameout)
+{
+	FILE *fpo;
+	struct fdata fdat;
+	char *bol, *eol;
+
+	fpo = dofopen(fnameout, "w");
+	fdat = readfile(fnamein, 0, 1);
+	bol = fdat.from +17;
+	while(bol < fdat.to) {
+		eol = memchr(bol, '\n', PATH_MAX);
+		fwrite(bol, 1, eol-bol+1, fpo);
+		bol = eol + 18;
+	} // while()
+	fclose(fpo);
+	free (fdat.from);
+} // stripinode()
+
+void sortlist(const char *in, const char *tmp1, const char *tmp2,
+				const char *out)
+{	// sort -u on inode and path, then drop the inode and sort on path.
+	char command[3 * PATH_MAX];
+
+	sprintf(command, "sort -u '%s' > '%s'", in, tmp1);
+	dosystem(command);
+	// get rid of the leading inode and sort on pathname
+	stripinode(tmp1, tmp2);
+	sprintf(command, "sort '%s' > '%s'", tmp2, out);
+	dosystem(command);
+} // sortlist()
@@ -14,5 +14,12 @@ struct fdata {
 struct fdata readfile(const char *filename, off_t extra, int fatal);
 FILE *dofopen(const char *path, const char *mode);
 void dumpfile(const char *dumpthis, FILE *dumpto);
+void *domalloc(size_t thesize);
+char *dostrdup(const char *s);
+void dorealpath(const char *givenpath, char *resolvedpath);
+void dosystem(const char *cmd);
+void stripinode(const char *fnamein, const char *fnameout);
+void sortlist(const char *in, const char *tmp1, const char *tmp2,
+				const char *out);
 
 #endif /* fileutil.h */
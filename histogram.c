@@ -0,0 +1,281 @@
+/*      histogram.c
+ *
+ *	Copyright 2015 Bob Parker <rlp1938@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *	MA 02110-1301, USA.
+*/
+
+/*
+ * Counts files and bytes by age against any number of cut offs in one
+ * walk. Each directory counts into its own table, merged into the
+ * totals when the directory is finished, so workers only take a lock
+ * once per directory.
+*/
+
+#include "histogram.h"
+#include "fileutil.h"
+#include "timeutil.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+
+#define HISTMAX 64
+#define HISTAUTO 14	// auto cut offs 1, 2, 4 ... 8192 days
+#define TOPHASH 1024
+
+struct cutoff {
+	time_t when;
+	char *label;
+};
+
+/* Counts for one directory, or for one top level directory. */
+struct histcount {
+	char *top;	// NULL unless counting by top level dir
+	long files[HISTMAX + 1];
+	long long bytes[HISTMAX + 1];
+	struct histcount *next;
+};
+
+static struct cutoff cutoffs[HISTMAX];
+static time_t when[HISTMAX];	// cutoffs[].when, oldest first
+static int ncutoffs;
+static int bytopdir;
+static struct histcount total;
+static struct histcount *tops[TOPHASH];
+static int ntops;
+static pthread_mutex_t histlock = PTHREAD_MUTEX_INITIALIZER;
+
+static int histenterdir(const char *path, void **dirdata, void *ctx);
+static void histvisit(const struct scanentry *e, void *dirdata,
+						void *ctx);
+static void histleavedir(const char *path, void *dirdata, void *ctx);
+static time_t parsecutoff(const char *spec);
+static int cmpcutoff(const void *a, const void *b);
+static int cmptop(const void *a, const void *b);
+static void printcounts(FILE *fp, const struct histcount *hc);
+
+static struct scanvisitor histogram = {
+	STATX_MTIME | STATX_SIZE | STATX_NLINK | STATX_INO, histenterdir,
+	histvisit, histleavedir, NULL, NULL
+};
+
+void histinit(const char *spec, int bytop)
+{	/* spec is a comma separated list of cut offs, each an age as for
+	 * -a or a date as for -o, or "auto" for log spaced ages from a day
+	 * to about 22 years. */
+	char work[PATH_MAX];
+	char *item;
+	int i;
+
+	bytopdir = bytop;
+	if (strcmp(spec, "auto") == 0) {
+		for (i = 0; i < HISTAUTO; i++) {
+			sprintf(work, "%dD", 1 << i);
+			cutoffs[i].label = dostrdup(work);
+			cutoffs[i].when = cutofftimebyage(1 << i, 'D');
+		}
+		ncutoffs = HISTAUTO;
+	} else {
+		strcpy(work, spec);
+		for (item = strtok(work, ","); item; item = strtok(NULL, ",")) {
+			if (ncutoffs == HISTMAX) {
+				fprintf(stderr, "No more than %d cut offs\n", HISTMAX);
+				exit(EXIT_FAILURE);
+			}
+			cutoffs[ncutoffs].label = dostrdup(item);
+			cutoffs[ncutoffs].when = parsecutoff(item);
+			ncutoffs++;
+		}
+	}
+	qsort(cutoffs, ncutoffs, sizeof(struct cutoff), cmpcutoff);
+	for (i = 0; i < ncutoffs; i++) when[i] = cutoffs[i].when;
+} // histinit()
+
+struct scanvisitor *histvisitor(void)
+{
+	return &histogram;
+} // histvisitor()
+
+time_t parsecutoff(const char *spec)
+{	// yyyymmdd[hh[mm]] is a date, otherwise N[YyMmDd] is an age.
+	time_t t;
+	size_t i, len = strlen(spec);
+	char aunit = 'Y';
+
+	for (i = 0; i < len && isdigit((unsigned char)spec[i]); i++)
+		;
+	if (i == len && len >= 8) {
+		t = parsetimestring(spec);
+	} else if (i && i + 1 >= len) {
+		if (spec[i] == 'M' || spec[i] == 'm') aunit = 'M';
+		if (spec[i] == 'D' || spec[i] == 'd') aunit = 'D';
+		t = cutofftimebyage(strtol(spec, NULL, 10), aunit);
+	} else {
+		fprintf(stderr, "%s is not an age or a date\n", spec);
+		t = (time_t)-1;
+	}
+	if (t == (time_t)-1) exit(EXIT_FAILURE);
+	return t;
+} // parsecutoff()
+
+static inline int bucketof(time_t mtime)
+{	/* Number of cut offs at or before mtime, so 0 is older than all of
+	 * them. A binary search whose step is a conditional add rather than
+	 * a branch, so it costs the same whatever the data. */
+	const time_t *base = when;
+	int n = ncutoffs;
+	int half;
+
+	if (!(n)) return 0;
+	while (n > 1) {
+		half = n / 2;
+		base += (base[half] <= mtime) ? half : 0;
+		n -= half;
+	}
+	return (base - when) + (*base <= mtime);
+} // bucketof()
+
+int histenterdir(const char *path, void **dirdata, void *ctx)
+{	// a fresh table for this dir, knowing which top level dir it is in.
+	struct histcount *hc = domalloc(sizeof(struct histcount));
+	const char *root, *slash;
+
+	(void)ctx;
+	memset(hc, 0, sizeof(struct histcount));
+	if (bytopdir) {
+		root = scanrootof(path);
+		slash = path + strlen(root);
+		if (*slash == '/') slash++;
+		if (!(*slash)) {
+			hc->top = dostrdup(path);	// files right in the root
+		} else {
+			slash = strchr(slash, '/');
+			hc->top = slash ? strndup(path, slash - path) : dostrdup(path);
+		}
+	}
+	*dirdata = hc;
+	return SCAN_ALL;
+} // histenterdir()
+
+void histvisit(const struct scanentry *e, void *dirdata, void *ctx)
+{
+	struct histcount *hc = dirdata;
+	int b;
+
+	(void)ctx;
+	if (e->type != DT_REG || !(e->stx)) return;
+	if (e->linkseen) return;	// counted under its first name
+	b = bucketof(e->stx->stx_mtime.tv_sec);
+	hc->files[b]++;
+	hc->bytes[b] += e->stx->stx_size;
+} // histvisit()
+
+void histleavedir(const char *path, void *dirdata, void *ctx)
+{	// add this dir's counts to the totals and its top level dir's.
+	struct histcount *hc = dirdata;
+	struct histcount *top = NULL;
+	unsigned h = 0;
+	const char *cp;
+	int i;
+
+	(void)path;
+	(void)ctx;
+	pthread_mutex_lock(&histlock);
+	if (bytopdir) {
+		for (cp = hc->top; *cp; cp++) h = h * 31 + (unsigned char)*cp;
+		h %= TOPHASH;
+		for (top = tops[h]; top; top = top->next) {
+			if (strcmp(top->top, hc->top) == 0) break;
+		}
+		if (!(top)) {
+			top = domalloc(sizeof(struct histcount));
+			memset(top, 0, sizeof(struct histcount));
+			top->top = dostrdup(hc->top);
+			top->next = tops[h];
+			tops[h] = top;
+			ntops++;
+		}
+	}
+	for (i = 0; i <= ncutoffs; i++) {
+		total.files[i] += hc->files[i];
+		total.bytes[i] += hc->bytes[i];
+		if (top) {
+			top->files[i] += hc->files[i];
+			top->bytes[i] += hc->bytes[i];
+		}
+	}
+	pthread_mutex_unlock(&histlock);
+	free(hc->top);
+	free(hc);
+} // histleavedir()
+
+void histprint(FILE *fp)
+{	// the totals, then each top level dir in path order.
+	struct histcount **all;
+	struct histcount *hc;
+	int h, i;
+
+	printcounts(fp, &total);
+	if (!(bytopdir)) return;
+	all = domalloc(sizeof(struct histcount *) * (ntops + 1));
+	i = 0;
+	for (h = 0; h < TOPHASH; h++) {
+		for (hc = tops[h]; hc; hc = hc->next) all[i++] = hc;
+	}
+	qsort(all, ntops, sizeof(struct histcount *), cmptop);
+	for (i = 0; i < ntops; i++) {
+		fprintf(fp, "\n%s\n", all[i]->top);
+		printcounts(fp, all[i]);
+	}
+	free(all);
+} // histprint()
+
+void printcounts(FILE *fp, const struct histcount *hc)
+{	// newest first, each row labelled with the cut offs either side.
+	char label[PATH_MAX];
+	int b;
+
+	fprintf(fp, "%-24s %10s %16s\n", "age", "files", "bytes");
+	for (b = ncutoffs; b >= 0; b--) {
+		if (b == ncutoffs) {
+			sprintf(label, "< %s", ncutoffs ? cutoffs[b-1].label : "all");
+		} else if (b == 0) {
+			sprintf(label, ">= %s", cutoffs[0].label);
+		} else {
+			sprintf(label, "%s - %s", cutoffs[b].label,
+						cutoffs[b-1].label);
+		}
+		fprintf(fp, "%-24s %10ld %16lld\n", label, hc->files[b],
+					hc->bytes[b]);
+	}
+} // printcounts()
+
+int cmpcutoff(const void *a, const void *b)
+{	// oldest first
+	const struct cutoff *ca = a;
+	const struct cutoff *cb = b;
+	return (ca->when > cb->when) - (ca->when < cb->when);
+} // cmpcutoff()
+
+int cmptop(const void *a, const void *b)
+{
+	const struct histcount *ha = *(struct histcount * const *)a;
+	const struct histcount *hb = *(struct histcount * const *)b;
+	return strcmp(ha->top, hb->top);
+} // cmptop()
@@ -0,0 +1,11 @@
+#ifndef _HISTOGRAM_H
+#define _HISTOGRAM_H 1
+
+#include <stdio.h>
+#include "scan.h"
+
+void histinit(const char *spec, int bytop);
+struct scanvisitor *histvisitor(void);
+void histprint(FILE *fp);
+
+#endif /* histogram.h */
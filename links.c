@@ -0,0 +1,290 @@
+/*      links.c
+ *
+ *	Copyright 2015 Bob Parker <rlp1938@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *	MA 02110-1301, USA.
+*/
+
+/*
+ * The files with more than one name met during a walk, keyed on device
+ * and inode. The walk looks each regular file up by the inode number
+ * readdir() gives it, so the second and later names of a file need no
+ * stat(), and counts how many names of each it has seen.
+ *
+ * Workers add and look up at once so the table is split in LINKSHARDS
+ * independently locked hash tables, each grown as it fills.
+ *
+ * Migration to another device also keeps the archive copy of each file
+ * here, so its other names become links to that copy instead of copies
+ * of their own.
+*/
+
+#include "links.h"
+#include "fileutil.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define LINKSHARDS 64
+
+/* Only what the visitors use is kept, a whole statx is 256 bytes and
+ * a backup tree may hold millions of these. */
+struct linkinode {
+	dev_t dev;
+	ino_t ino;
+	unsigned seen;	// names met so far
+	unsigned int mask;
+	unsigned short mode;
+	unsigned int nlink;
+	uid_t uid;
+	gid_t gid;
+	unsigned long long size;
+	unsigned long long blocks;
+	unsigned int dev_major, dev_minor;
+	struct statx_timestamp atime, mtime, ctime;
+	char *archive;	// where migration copied it, NULL if not yet
+	int copying;	// a migration worker is copying it now
+	struct linkinode *next;
+};
+
+struct linkshard {
+	pthread_mutex_t lock;
+	pthread_cond_t copied;	// a copy in this shard finished or failed
+	struct linkinode **bucket;
+	size_t nbuckets;	// a power of 2, or 0 until first used
+	size_t count;
+};
+
+static struct linkshard shards[LINKSHARDS];
+static pthread_once_t linkonce = PTHREAD_ONCE_INIT;
+
+static void linkinit(void);
+static unsigned long linkhash(dev_t dev, ino_t ino);
+static struct linkinode *lookup(struct linkshard *ls, unsigned long h,
+								dev_t dev, ino_t ino);
+static void grow(struct linkshard *ls);
+static void fromstatx(struct linkinode *li, const struct statx *stx);
+static void tostatx(const struct linkinode *li, struct statx *stx);
+static int getlink(dev_t dev, ino_t ino, struct statx *stx,
+					unsigned *seen, int count);
+
+unsigned linkadd(dev_t dev, const struct statx *stx)
+{	// record one name of stx, return how many were met before it.
+	unsigned long h = linkhash(dev, stx->stx_ino);
+	struct linkshard *ls = &shards[h % LINKSHARDS];
+	struct linkinode *li;
+	unsigned seen;
+
+	pthread_once(&linkonce, linkinit);
+	pthread_mutex_lock(&ls->lock);
+	li = lookup(ls, h, dev, stx->stx_ino);
+	if (!(li)) {
+		// first sight, though another worker may beat us to the next
+		if (ls->count >= ls->nbuckets) grow(ls);
+		li = domalloc(sizeof(struct linkinode));
+		li->dev = dev;
+		li->ino = stx->stx_ino;
+		li->seen = 0;
+		li->archive = (char *)NULL;
+		li->copying = 0;
+		fromstatx(li, stx);
+		h = (h / LINKSHARDS) & (ls->nbuckets - 1);
+		li->next = ls->bucket[h];
+		ls->bucket[h] = li;
+		ls->count++;
+	}
+	seen = li->seen++;
+	pthread_mutex_unlock(&ls->lock);
+	return seen;
+} // linkadd()
+
+int linkfind(dev_t dev, ino_t ino, struct statx *stx, unsigned *seen)
+{	/* if dev/ino is known fill stx from the table, put how many names
+	 * were met before this one in seen and count this one. */
+	return getlink(dev, ino, stx, seen, 1);
+} // linkfind()
+
+int linkget(dev_t dev, ino_t ino, struct statx *stx, unsigned *seen)
+{	// as linkfind() without counting a name, for after the walk.
+	return getlink(dev, ino, stx, seen, 0);
+} // linkget()
+
+int linkarchive(dev_t dev, ino_t ino, char *archive)
+{	/* Before migrating a name of dev/ino across devices. Returns 1 with
+	 * the path of the archive copy in archive if another name has been
+	 * copied already. Otherwise returns 0 and the caller copies it and
+	 * must then call linkarchived(), other names wait till it does. */
+	unsigned long h = linkhash(dev, ino);
+	struct linkshard *ls = &shards[h % LINKSHARDS];
+	struct linkinode *li;
+	int done = 0;
+
+	pthread_once(&linkonce, linkinit);
+	pthread_mutex_lock(&ls->lock);
+	li = lookup(ls, h, dev, ino);
+	if (li) {
+		while (li->copying) pthread_cond_wait(&ls->copied, &ls->lock);
+		if (li->archive) {
+			strcpy(archive, li->archive);
+			done = 1;
+		} else {
+			li->copying = 1;
+		}
+	}
+	pthread_mutex_unlock(&ls->lock);
+	return done;
+} // linkarchive()
+
+void linkarchived(dev_t dev, ino_t ino, const char *archive)
+{	// the copy claimed by linkarchive() is at archive, NULL if it failed.
+	unsigned long h = linkhash(dev, ino);
+	struct linkshard *ls = &shards[h % LINKSHARDS];
+	struct linkinode *li;
+
+	pthread_once(&linkonce, linkinit);
+	pthread_mutex_lock(&ls->lock);
+	li = lookup(ls, h, dev, ino);
+	if (li) {
+		if (archive) li->archive = dostrdup(archive);
+		li->copying = 0;
+		pthread_cond_broadcast(&ls->copied);
+	}
+	pthread_mutex_unlock(&ls->lock);
+} // linkarchived()
+
+void linkforeach(linkfn fn, void *ctx)
+{	// every file in the table, not to be used while the walk runs.
+	struct linkinode *li;
+	struct statx stx;
+	size_t i;
+	int s;
+
+	for (s = 0; s < LINKSHARDS; s++) {
+		for (i = 0; i < shards[s].nbuckets; i++) {
+			for (li = shards[s].bucket[i]; li; li = li->next) {
+				tostatx(li, &stx);
+				fn(li->dev, &stx, li->seen, ctx);
+			}
+		}
+	}
+} // linkforeach()
+
+int getlink(dev_t dev, ino_t ino, struct statx *stx, unsigned *seen,
+				int count)
+{
+	unsigned long h = linkhash(dev, ino);
+	struct linkshard *ls = &shards[h % LINKSHARDS];
+	struct linkinode *li;
+
+	pthread_once(&linkonce, linkinit);
+	pthread_mutex_lock(&ls->lock);
+	li = lookup(ls, h, dev, ino);
+	if (li) {
+		tostatx(li, stx);
+		*seen = li->seen;
+		if (count) li->seen++;
+	}
+	pthread_mutex_unlock(&ls->lock);
+	return li != NULL;
+} // getlink()
+
+void linkinit(void)
+{
+	int s;
+
+	for (s = 0; s < LINKSHARDS; s++) {
+		pthread_mutex_init(&shards[s].lock, NULL);
+		pthread_cond_init(&shards[s].copied, NULL);
+	}
+} // linkinit()
+
+unsigned long linkhash(dev_t dev, ino_t ino)
+{	// inode numbers are often sequential, spread them.
+	unsigned long long h = ((unsigned long long)ino ^
+							((unsigned long long)dev << 40));
+	h *= 0x9e3779b97f4a7c15ULL;
+	return (unsigned long)(h >> 16);
+} // linkhash()
+
+struct linkinode *lookup(struct linkshard *ls, unsigned long h,
+							dev_t dev, ino_t ino)
+{	// Caller holds ls->lock.
+	struct linkinode *li;
+
+	if (!(ls->nbuckets)) return NULL;
+	li = ls->bucket[(h / LINKSHARDS) & (ls->nbuckets - 1)];
+	for (; li; li = li->next) {
+		if (li->ino == ino && li->dev == dev) return li;
+	}
+	return NULL;
+} // lookup()
+
+void grow(struct linkshard *ls)
+{	// double the buckets and rehash. Caller holds ls->lock.
+	size_t n = ls->nbuckets ? 2 * ls->nbuckets : 1024;
+	struct linkinode **nb = domalloc(sizeof(struct linkinode *) * n);
+	struct linkinode *li, *next;
+	unsigned long h;
+	size_t i;
+
+	memset(nb, 0, sizeof(struct linkinode *) * n);
+	for (i = 0; i < ls->nbuckets; i++) {
+		for (li = ls->bucket[i]; li; li = next) {
+			next = li->next;
+			h = (linkhash(li->dev, li->ino) / LINKSHARDS) & (n - 1);
+			li->next = nb[h];
+			nb[h] = li;
+		}
+	}
+	free(ls->bucket);
+	ls->bucket = nb;
+	ls->nbuckets = n;
+} // grow()
+
+void fromstatx(struct linkinode *li, const struct statx *stx)
+{
+	li->mask = stx->stx_mask;
+	li->mode = stx->stx_mode;
+	li->nlink = stx->stx_nlink;
+	li->uid = stx->stx_uid;
+	li->gid = stx->stx_gid;
+	li->size = stx->stx_size;
+	li->blocks = stx->stx_blocks;
+	li->dev_major = stx->stx_dev_major;
+	li->dev_minor = stx->stx_dev_minor;
+	li->atime = stx->stx_atime;
+	li->mtime = stx->stx_mtime;
+	li->ctime = stx->stx_ctime;
+} // fromstatx()
+
+void tostatx(const struct linkinode *li, struct statx *stx)
+{
+	memset(stx, 0, sizeof(struct statx));
+	stx->stx_mask = li->mask & STATX_BASIC_STATS;
+	stx->stx_mode = li->mode;
+	stx->stx_nlink = li->nlink;
+	stx->stx_uid = li->uid;
+	stx->stx_gid = li->gid;
+	stx->stx_ino = li->ino;
+	stx->stx_size = li->size;
+	stx->stx_blocks = li->blocks;
+	stx->stx_dev_major = li->dev_major;
+	stx->stx_dev_minor = li->dev_minor;
+	stx->stx_atime = li->atime;
+	stx->stx_mtime = li->mtime;
+	stx->stx_ctime = li->ctime;
+} // tostatx()
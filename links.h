@@ -0,0 +1,18 @@
+#ifndef _LINKS_H
+#define _LINKS_H 1
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+typedef void (*linkfn)(dev_t dev, const struct statx *stx, unsigned seen,
+						void *ctx);
+
+unsigned linkadd(dev_t dev, const struct statx *stx);
+int linkfind(dev_t dev, ino_t ino, struct statx *stx, unsigned *seen);
+int linkget(dev_t dev, ino_t ino, struct statx *stx, unsigned *seen);
+int linkarchive(dev_t dev, ino_t ino, char *archive);
+void linkarchived(dev_t dev, ino_t ino, const char *archive);
+void linkforeach(linkfn fn, void *ctx);
+
+#endif /* links.h */
@@ -0,0 +1,416 @@
+/*      migrate.c
+ *
+ *	Copyright 2015 Bob Parker <rlp1938@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *	MA 02110-1301, USA.
+*/
+
+/*
+ * Moves old files into an archive tree as the walk finds them. The file
+ * /a/b/c goes to destdir/a/b/c. On the same device that is a rename(),
+ * otherwise the data is cloned or copied inside the kernel by a small
+ * pool of workers, the copy is synced and checked and only then is the
+ * original removed. A file with several names is copied once, its other
+ * names are made links to the copy. The walk blocks when the pool falls
+ * MIGRATEQUEUE files behind.
+*/
+
+#include "migrate.h"
+#include "links.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+
+#define MIGRATEQUEUE 64
+
+struct migration {
+	char *path;
+	struct stat sb;	// as the walk saw it
+	struct migration *next;
+};
+
+static char *destdir;
+static dev_t destdev;
+static int nworkers;
+static pthread_t *worker;
+static struct migration *qhead, *qtail;
+static int qlen;
+static int finished;
+static pthread_mutex_t migratelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t notempty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t notfull = PTHREAD_COND_INITIALIZER;
+static long moved, failed;
+static long long movedbytes;
+
+static void *migrateworker(void *arg);
+static int migrateone(const struct migration *mg);
+static int copyone(const struct migration *mg, const char *dest,
+					const char *tmp);
+static int linkone(const struct migration *mg, const char *first,
+					const char *dest);
+static int finishone(const struct migration *mg);
+static void syncparent(const char *path);
+static int makeparents(const char *dest);
+static int copydata(int in, int out, off_t size);
+
+void migrateinit(const char *dir, int workers)
+{
+	struct stat sb;
+	int i;
+
+	if (stat(dir, &sb) == -1) {
+		perror(dir);
+		exit(EXIT_FAILURE);
+	}
+	if (!(S_ISDIR(sb.st_mode))) {
+		fprintf(stderr, "%s is not a directory!\n", dir);
+		exit(EXIT_FAILURE);
+	}
+	destdir = strdup(dir);
+	destdev = sb.st_dev;
+	if (destdir && strlen(destdir) > 1 && destdir[strlen(destdir)-1] == '/') {
+		destdir[strlen(destdir)-1] = '\0';
+	}
+	nworkers = workers;
+	worker = malloc(sizeof(pthread_t) * nworkers);
+	if (!(destdir) || !(worker)) {
+		perror("malloc()");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < nworkers; i++) {
+		errno = pthread_create(&worker[i], NULL, migrateworker, NULL);
+		if (errno) {
+			perror("pthread_create()");
+			exit(EXIT_FAILURE);
+		}
+	}
+} // migrateinit()
+
+void migratefile(const char *path, const struct stat *sb)
+{	// queue path for moving, waiting while the workers are behind.
+	struct migration *mg = malloc(sizeof(struct migration));
+
+	if (!(mg) || !(mg->path = strdup(path))) {
+		perror("malloc()");
+		exit(EXIT_FAILURE);
+	}
+	mg->sb = *sb;
+	mg->next = (struct migration *)NULL;
+	pthread_mutex_lock(&migratelock);
+	while (qlen >= MIGRATEQUEUE) pthread_cond_wait(&notfull, &migratelock);
+	if (qtail) {
+		qtail->next = mg;
+	} else {
+		qhead = mg;
+	}
+	qtail = mg;
+	qlen++;
+	pthread_cond_signal(&notempty);
+	pthread_mutex_unlock(&migratelock);
+} // migratefile()
+
+void migratefinish(int quiet)
+{	// wait for the queue to drain and say how it went.
+	int i;
+
+	pthread_mutex_lock(&migratelock);
+	finished = 1;
+	pthread_cond_broadcast(&notempty);
+	pthread_mutex_unlock(&migratelock);
+	for (i = 0; i < nworkers; i++) pthread_join(worker[i], NULL);
+	if (!(quiet) || failed) {
+		fprintf(stderr, "Migrated %ld files, %lld bytes, to %s. %ld failed.\n",
+					moved, movedbytes, destdir, failed);
+	}
+} // migratefinish()
+
+void *migrateworker(void *arg)
+{
+	struct migration *mg;
+	int ok;
+
+	(void)arg;
+	for (;;) {
+		pthread_mutex_lock(&migratelock);
+		while (!(qhead) && !(finished)) {
+			pthread_cond_wait(&notempty, &migratelock);
+		}
+		mg = qhead;
+		if (!(mg)) {	// finished and nothing left
+			pthread_mutex_unlock(&migratelock);
+			break;
+		}
+		qhead = mg->next;
+		if (!(qhead)) qtail = (struct migration *)NULL;
+		qlen--;
+		pthread_cond_signal(&notfull);
+		pthread_mutex_unlock(&migratelock);
+
+		ok = migrateone(mg);
+
+		pthread_mutex_lock(&migratelock);
+		if (ok) {
+			moved++;
+			// a link to an earlier copy moves no more data
+			if (ok == 1) movedbytes += mg->sb.st_size;
+		} else {
+			failed++;
+		}
+		pthread_mutex_unlock(&migratelock);
+		free(mg->path);
+		free(mg);
+	}
+	return NULL;
+} // migrateworker()
+
+int migrateone(const struct migration *mg)
+{	/* Move one file, returns 1 if it is now in the archive and gone
+	 * from where it was, 2 if that was done by linking it to the copy
+	 * of another of its names. Any failure leaves the original in
+	 * place. */
+	char dest[PATH_MAX], tmp[PATH_MAX], first[PATH_MAX];
+	struct stat sb;
+	int ok;
+
+	if (snprintf(dest, PATH_MAX, "%s%s", destdir, mg->path) >= PATH_MAX ||
+		snprintf(tmp, PATH_MAX, "%s.oldfiles-tmp", dest) >= PATH_MAX) {
+		fprintf(stderr, "%s: archive path too long\n", mg->path);
+		return 0;
+	}
+	if (lstat(dest, &sb) == 0) {
+		if (S_ISREG(sb.st_mode) && sb.st_size == mg->sb.st_size &&
+				sb.st_mtime == mg->sb.st_mtime) {
+			// copied by a run that stopped before removing the original
+			return finishone(mg);
+		}
+		fprintf(stderr, "%s: already exists, not migrated\n", dest);
+		return 0;
+	}
+	if (makeparents(dest) == -1) return 0;
+
+	if (mg->sb.st_dev == destdev) {
+		if (rename(mg->path, dest) == 0) return 1;
+		if (errno != EXDEV) {	// another mount below destdir, copy it
+			perror(mg->path);
+			return 0;
+		}
+	}
+
+	if (mg->sb.st_nlink > 1) {
+		if (linkarchive(mg->sb.st_dev, mg->sb.st_ino, first)) {
+			return linkone(mg, first, dest) ? 2 : 0;
+		}
+		ok = copyone(mg, dest, tmp);
+		linkarchived(mg->sb.st_dev, mg->sb.st_ino, ok ? dest : NULL);
+		return ok;
+	}
+	return copyone(mg, dest, tmp);
+} // migrateone()
+
+int copyone(const struct migration *mg, const char *dest, const char *tmp)
+{	// copy to tmp, check it, rename it to dest and remove the original.
+	struct stat sb, dsb;
+	struct timespec times[2];
+	int in, out, ok;
+
+	// left by a run that stopped part way through copying
+	if (unlink(tmp) == -1 && errno != ENOENT) {
+		perror(tmp);
+		return 0;
+	}
+	in = open(mg->path, O_RDONLY | O_NOFOLLOW);
+	if (in == -1) {
+		perror(mg->path);
+		return 0;
+	}
+	out = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (out == -1) {
+		perror(tmp);
+		close(in);
+		return 0;
+	}
+	ok = 0;
+	if (fstat(in, &sb) == -1) {
+		perror(mg->path);
+	} else if (sb.st_mtime != mg->sb.st_mtime || sb.st_ino != mg->sb.st_ino) {
+		fprintf(stderr, "%s: changed since it was found, not migrated\n",
+					mg->path);
+	} else if (copydata(in, out, sb.st_size) == 0) {
+		times[0] = sb.st_atim;
+		times[1] = sb.st_mtim;
+		if (fchown(out, sb.st_uid, sb.st_gid) == -1 && errno != EPERM) {
+			perror(tmp);
+		} else if (fchmod(out, sb.st_mode & 07777) == -1 ||
+					futimens(out, times) == -1 || fsync(out) == -1 ||
+					fstat(out, &dsb) == -1) {
+			perror(tmp);
+		} else if (fstat(in, &sb) == -1) {
+			perror(mg->path);
+		} else if (dsb.st_size != sb.st_size ||
+					sb.st_mtime != mg->sb.st_mtime) {
+			fprintf(stderr, "%s: copy does not match, not migrated\n",
+						mg->path);
+		} else {
+			ok = 1;
+		}
+	}
+	close(in);
+	if (close(out) == -1) {
+		perror(tmp);
+		ok = 0;
+	}
+	if (!(ok)) {
+		unlink(tmp);
+		return 0;
+	}
+	if (rename(tmp, dest) == -1) {
+		perror(dest);
+		unlink(tmp);
+		return 0;
+	}
+	syncparent(dest);
+	if (unlink(mg->path) == -1) {
+		perror(mg->path);
+		return 0;
+	}
+	return 1;
+} // copyone()
+
+int linkone(const struct migration *mg, const char *first,
+				const char *dest)
+{	// dest becomes another name for first, the copy of mg's file.
+	struct stat sb;
+
+	if (lstat(mg->path, &sb) == -1) {
+		perror(mg->path);
+		return 0;
+	}
+	if (sb.st_ino != mg->sb.st_ino || sb.st_mtime != mg->sb.st_mtime) {
+		fprintf(stderr, "%s: changed since it was found, not migrated\n",
+					mg->path);
+		return 0;
+	}
+	if (link(first, dest) == -1) {
+		perror(dest);
+		return 0;
+	}
+	syncparent(dest);
+	if (unlink(mg->path) == -1) {
+		perror(mg->path);
+		return 0;
+	}
+	return 1;
+} // linkone()
+
+int finishone(const struct migration *mg)
+{	// the archive already has mg's file, just remove the original.
+	struct stat sb;
+
+	if (lstat(mg->path, &sb) == -1) {
+		perror(mg->path);
+		return 0;
+	}
+	if (sb.st_ino != mg->sb.st_ino || sb.st_mtime != mg->sb.st_mtime) {
+		fprintf(stderr, "%s: changed since it was found, not migrated\n",
+					mg->path);
+		return 0;
+	}
+	if (unlink(mg->path) == -1) {
+		perror(mg->path);
+		return 0;
+	}
+	return 1;
+} // finishone()
+
+void syncparent(const char *path)
+{	// make sure a new name is on disk before the old one goes.
+	char dir[PATH_MAX];
+	char *slash;
+	int dirfd;
+
+	strcpy(dir, path);
+	slash = strrchr(dir, '/');
+	*slash = '\0';
+	dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (dirfd != -1) {
+		fsync(dirfd);
+		close(dirfd);
+	}
+} // syncparent()
+
+int copydata(int in, int out, off_t size)
+{	/* Get the data across without it passing through user space, a
+	 * reflink if the file systems allow, else copy_file_range() and,
+	 * where that won't cross file systems, sendfile(). */
+	off_t done = 0;
+	ssize_t n;
+	int usesendfile = 0;
+
+	if (ioctl(out, FICLONE, in) == 0) return 0;
+	while (done < size) {
+		if (!(usesendfile)) {
+			n = copy_file_range(in, NULL, out, NULL, size - done, 0);
+			if (n == -1 && (errno == EXDEV || errno == EINVAL ||
+							errno == ENOSYS || errno == EOPNOTSUPP)) {
+				usesendfile = 1;
+				continue;
+			}
+		} else {
+			n = sendfile(out, in, NULL, size - done);
+		}
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			perror("copy");
+			return -1;
+		}
+		if (n == 0) break;	// file got shorter, the size check will fail
+		done += n;
+	}
+	return 0;
+} // copydata()
+
+int makeparents(const char *dest)
+{	/* mkdir -p the directory dest will go in, each new dir getting the
+	 * mode of the source dir it mirrors. */
+	char work[PATH_MAX];
+	char *slash;
+	size_t skip = strlen(destdir);
+	struct stat sb;
+
+	strcpy(work, dest);
+	for (slash = strchr(work + skip + 1, '/'); slash;
+			slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		if (mkdir(work, 0700) == 0) {
+			// work + skip is the source dir this one mirrors
+			if (stat(work + skip, &sb) == 0) chmod(work, sb.st_mode & 07777);
+		} else if (errno != EEXIST) {
+			perror(work);
+			return -1;
+		}
+		*slash = '/';
+	}
+	return 0;
+} // makeparents()
@@ -0,0 +1,10 @@
+#ifndef _MIGRATE_H
+#define _MIGRATE_H 1
+
+#include <sys/stat.h>
+
+void migrateinit(const char *destdir, int workers);
+void migratefile(const char *path, const struct stat *sb);
+void migratefinish(int quiet);
+
+#endif /* migrate.h */
@@ -31,16 +31,31 @@
 #include <time.h>
 #include <utime.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/resource.h>
+#include <sys/sysmacros.h>
 #include "fileutil.h"
+#include "scan.h"
+#include "timeutil.h"
+#include "checkpoint.h"
+#include "throttle.h"
+#include "migrate.h"
+#include "histogram.h"
+#include "compress.h"
+#include "links.h"
 static char *helpmsg =
   "NAME\n\toldfiles - lists old files and optionally deletes them"
   " or renews file\n\ttimes using the generated list."
   "\tAlso provides an option to delete empty\n\tdirectories.\n"
   "SYNOPSIS"
-  "\n\toldfiles [option] [topdir]\n"
+  "\n\toldfiles [option] [topdir ...]\n"
   "\n\tLists files under topdir which are older than the default age\n"
   "\tof 3 years to stdout, unless other options are used.\n"
   "\tBy default topdir is the user's home directory.\n"
+  "\tSeveral topdirs may be given, they are grouped by the device\n"
+  "\tthey live on and each device is scanned in parallel.\n"
   "\nDESCRIPTION\n"
   "\tOldfiles when run with no options or target directory specified,\n\t"
   "simply lists all files in the users home directory which are\n\t"
@@ -54,6 +69,41 @@ static char *helpmsg =
   "\t-o yyyymmdd[hh[mm]] Delete files older than this date.\n"
   "\t-q Quiet mode. When selected stops the 'No old files found.'"
   " message.\n"
+  "\t-j, --jobs N Use N worker threads per device, default 1.\n"
+  "\t-J, --device-jobs path=N Use N worker threads for the device\n"
+  "\t holding path, overriding -j. May be repeated.\n"
+  "\t-u, --by-owner Summarise old files and bytes per owner.\n"
+  "\t-g, --by-group As -u but per owner and group.\n"
+  "\t-O, --owner-dir dir Write the per owner summary to dir/summary\n"
+  "\t and each owner's list of old files to dir/owner.list. Implies\n"
+  "\t -u.\n"
+  "\t-c, --checkpoint file Journal finished directories and the old\n"
+  "\t files found so far to file as the scan goes.\n"
+  "\t-r, --resume Carry on from the journal given by -c instead of\n"
+  "\t starting again, directories already done are not rescanned.\n"
+  "\t-m, --max-stats-per-sec N Do no more than N stat()s a second.\n"
+  "\t-A, --adaptive Slow down while stat() and directory reads take\n"
+  "\t longer than they do on an idle system.\n"
+  "\t Either of -m or -A also selects idle io and lowest cpu priority.\n"
+  "\t-M, --migrate-to dir Move old files to the same path under dir\n"
+  "\t instead of just listing them.\n"
+  "\t-W, --migrate-jobs N Copy up to N files at once when dir is on\n"
+  "\t another device, default 2.\n"
+  "\t-H, --histogram list Instead of listing old files count files and\n"
+  "\t bytes by age. list is comma separated ages as for -a or dates\n"
+  "\t as for -o, or 'auto' for ages of 1, 2, 4 ... 8192 days.\n"
+  "\t-T, --histogram-by-top As -H but also per top level directory.\n"
+  "\t-S, --stream Write old files to stdout as they are found, not\n"
+  "\t sorted, instead of once the scan is done. No work files are\n"
+  "\t written. A symlink target may be listed more than once.\n"
+  "\t-z, --compress[=gzip|zstd] Compress the list written to stdout,\n"
+  "\t zstd if built in otherwise gzip. Without -S it is the sorted\n"
+  "\t list that is compressed, after the scan. With -S the list is\n"
+  "\t compressed in parallel blocks as the scan goes and can be read\n"
+  "\t from a pipe while the scan runs.\n"
+  "\t-Z, --compress-jobs N Compress with N threads, default 4.\n"
+  "\t-L, --link-groups file Write the old files with more than one\n"
+  "\t name to file, all the names of each together.\n"
 ;
 //Global vars
 static FILE *fpo;
@@ -73,44 +123,124 @@ struct listitem {
 
 static struct listitem *head;
 
+static pthread_mutex_t outlock = PTHREAD_MUTEX_INITIALIZER;
+
+/* With -u or -g matches are also counted against whoever owns them,
+ * each owner has its own list file and lock so workers reporting on
+ * different owners don't wait on one another. */
+#define OWNERHASH 256
+struct owner {
+	uid_t uid;
+	gid_t gid;	// (gid_t)-1 unless grouping by group too
+	char *name;
+	long count;
+	long long bytes;
+	long long reclaim;	// bytes freed by deleting all of the list
+	FILE *fpl;	// unsorted list, NULL without -O
+	char *listfn;
+	pthread_mutex_t lock;
+	struct owner *next;
+};
+
+static int byowner;	// 0 off, 1 by owner, 2 by owner and group
+static char *ownerdir;
+static char *ownertmp;	// per owner work files start with this
+static struct owner *owners[OWNERHASH];
+static int nowners;
+static pthread_mutex_t ownerlock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *cpfn;	// checkpoint journal, NULL for none
+static int resume;
+
+static int stream;	// list matches as found, not sorted at the end
+static struct cwriter *cw;	// compresses the stream, NULL for plain
+static char *linkgroups;	// hard link report, NULL for none
+static FILE *fplinks;
+static char *migrateto;	// archive dir, NULL to leave files alone
+
 struct listitem *newlistitem(void);
-static void recursedir(char *topdir);
-static char *dostrdup(const char *s);
+static int oldenterdir(const char *path, void **dirdata, void *ctx);
+static void oldvisit(const struct scanentry *e, void *dirdata, void *ctx);
+static void oldleavedir(const char *path, void *dirdata, void *ctx);
+static void oldsubtreedone(const char *path, void *ctx);
+static void foundold(struct cpbuf *cb, const char *path,
+						const struct stat *sb, int tally);
+static void replayold(const char *path, const struct stat *sb, int tally);
+static void reportold(const char *path, const struct stat *sb,
+						int tally);
+static void reportlink(const char *path, const struct stat *sb);
+static void partlink(dev_t dev, const struct statx *stx, unsigned seen,
+						void *ctx);
+static void writelinkgroups(void);
+static struct owner *findowner(uid_t uid, gid_t gid);
+static void writeowners(void);
+static int cmpowner(const void *a, const void *b);
 static void dohelp(int forced);
 int numdiritems(char *testdir);
 struct listitem *insertbefore(char *name, struct listitem *head);
-time_t cutofftimebyage(int age, char aunit);
-time_t parsetimestring(const char *dts);
-int validday(int yy, int mon, int dd);
-int leapyear(int yy);
-static void dorealpath(char *givenpath, char *resolvedpath);
-static void  dosystem(const char *cmd);
 static char** workfiles(const char *dir, const char *progname,
 						int numfiles);
-static void* domalloc(size_t thesize);
-static void stripinode(const char *fnamein, const char *fnameout);
+
+static struct scanvisitor oldvisitor = {
+	STATX_BASIC_STATS, oldenterdir, oldvisit, oldleavedir, oldsubtreedone,
+	NULL
+};
 
 int main(int argc, char **argv)
 {
-    int opt, age, quiet;
-    char topdir[PATH_MAX];
+    int opt, age, quiet, adaptive, migratejobs, jobs;
+    double maxrate;
     char aunit = 'Y';
     struct stat sb;
     char *datestr;
-	char command[PATH_MAX];
+    char *histspec;
+    int bytop;
+    char *compress;
+    int compressjobs;
 	char **workfile;
+	int i;
+	static struct option long_options[] = {
+		{"help",		no_argument,		0,	'h'},
+		{"jobs",		required_argument,	0,	'j'},
+		{"device-jobs",	required_argument,	0,	'J'},
+		{"by-owner",	no_argument,		0,	'u'},
+		{"by-group",	no_argument,		0,	'g'},
+		{"owner-dir",	required_argument,	0,	'O'},
+		{"checkpoint",	required_argument,	0,	'c'},
+		{"resume",		no_argument,		0,	'r'},
+		{"max-stats-per-sec",	required_argument,	0,	'm'},
+		{"adaptive",	no_argument,		0,	'A'},
+		{"migrate-to",	required_argument,	0,	'M'},
+		{"migrate-jobs",	required_argument,	0,	'W'},
+		{"histogram",	required_argument,	0,	'H'},
+		{"histogram-by-top",	no_argument,	0,	'T'},
+		{"stream",		no_argument,		0,	'S'},
+		{"compress",	optional_argument,	0,	'z'},
+		{"compress-jobs",	required_argument,	0,	'Z'},
+		{"link-groups",	required_argument,	0,	'L'},
+		{0,	0,	0,	0}
+	};
 
     // set up defaults
     quiet = 0;
+    adaptive = 0;
+    migratejobs = 2;
+    histspec = (char *)NULL;
+    bytop = 0;
+    compress = (char *)NULL;
+    compressjobs = 4;
+    maxrate = 0.0;
     age = 3;
-    strcpy(topdir, getenv("HOME"));
     head = newlistitem();
     opfn = (char *)NULL;
     oldcount = 0;
     workfile = workfiles("/tmp/", argv[0], 4);
     fpo=dofopen(workfile[0], "w");
+    ownertmp = workfile[0];
 
-    while((opt = getopt(argc, argv, ":ha:o:q")) != -1) {
+    while((opt = getopt_long(argc, argv,
+							":ha:o:qj:J:ugO:c:rm:AM:W:H:TSz::Z:L:",
+								long_options, NULL)) != -1) {
         switch(opt){
         /* I have no idea what the value of topdir will be during
          * options processing so all I can do is set a task variable
@@ -130,9 +260,83 @@ int main(int argc, char **argv)
         case 'q':
 			quiet = 1;
         break;
+        case 'j':	// workers per device
+			jobs = strtol(optarg, NULL, 10);
+			if (jobs < 1) {
+				fprintf(stderr, "Illegal value for jobs: %s\n", optarg);
+				dohelp(1);
+			}
+			scansetjobs(jobs);
+        break;
+        case 'J':	// workers for one particular device
+			scandevlimit(optarg);
+        break;
+        case 'u':	// summarise by owner
+			if (!(byowner)) byowner = 1;
+        break;
+        case 'g':	// summarise by owner and group
+			byowner = 2;
+        break;
+        case 'O':	// per owner lists go here
+			ownerdir = dostrdup(optarg);
+			if (!(byowner)) byowner = 1;
+        break;
+        case 'c':	// journal progress here
+			cpfn = dostrdup(optarg);
+        break;
+        case 'r':	// pick up from the journal
+			resume = 1;
+        break;
+        case 'm':	// cap the stat rate
+			maxrate = strtod(optarg, NULL);
+			if (maxrate <= 0) {
+				fprintf(stderr, "Illegal value for stats per second: %s\n",
+							optarg);
+				dohelp(1);
+			}
+        break;
+        case 'A':	// back off when the disks are busy
+			adaptive = 1;
+        break;
+        case 'M':	// move old files to the archive
+			migrateto = dostrdup(optarg);
+        break;
+        case 'W':	// archive copy workers
+			migratejobs = strtol(optarg, NULL, 10);
+			if (migratejobs < 1) {
+				fprintf(stderr, "Illegal value for migrate jobs: %s\n",
+							optarg);
+				dohelp(1);
+			}
+        break;
+        case 'H':	// age histogram instead of a list
+			histspec = dostrdup(optarg);
+        break;
+        case 'T':	// and per top level dir
+			bytop = 1;
+        break;
+        case 'S':	// unsorted, as found
+			stream = 1;
+        break;
+        case 'z':	// compressed list, optionally saying how
+			compress = optarg ? dostrdup(optarg) : "";
+			cwmethod(compress[0] ? compress : NULL);
+        break;
+        case 'Z':	// compression threads
+			compressjobs = strtol(optarg, NULL, 10);
+			if (compressjobs < 1) {
+				fprintf(stderr, "Illegal value for compress jobs: %s\n",
+							optarg);
+				dohelp(1);
+			}
+        break;
+        case 'L':	// hard linked files, grouped
+			linkgroups = dostrdup(optarg);
+        break;
         case 'o':   // list files older than input file time
             datestr = strdup(optarg);
             fileage = parsetimestring(datestr);
+            if (fileage == (time_t)-1) dohelp(1);
         break;
         case ':':
             fprintf(stderr, "Option %c requires an argument\n",optopt);
@@ -147,45 +351,103 @@ int main(int argc, char **argv)
 
     // now process the non-option arguments
 
-    // 1.See if argv[1] exists.
-    if ((argv[optind])) {
-       strcpy(topdir, argv[optind]);  // default is /home/$USER
-    }
+    // 1.See if any topdirs were given, default is /home/$USER
+    if (argc > optind) {
+		for (i = optind; i < argc; i++) scanaddroot(argv[i]);
+	} else {
+		scanaddroot(getenv("HOME"));
+	}
 
-    // Check that the top dir is legitimate.
-    if (stat(topdir, &sb) == -1) {
-        perror(topdir);
-        exit(EXIT_FAILURE);
-    }
-    // It exists then, but is it a dir?
-    if (!(S_ISDIR(sb.st_mode))) {
-        fprintf(stderr, "%s is not a directory!\n", topdir);
-        exit(EXIT_FAILURE);
-    }
+	if (bytop && !(histspec)) histspec = "auto";
+	if (histspec) {
+		if (migrateto || cpfn || byowner) {
+			fprintf(stderr, "--histogram doesn't go with -M, -c or -u\n");
+			dohelp(1);
+		}
+		histinit(histspec, bytop);
+		throttleinit(maxrate, adaptive);
+		scanaddvisitor(histvisitor());
+		scanrun();
+		fclose(fpo);
+		unlink(workfile[0]);
+		histprint(stdout);
+		return 0;
+	}
 
-	// Convert relative path to absolute if needed.
-	if (topdir[0] != '/') dorealpath(argv[optind], topdir);
+	if (ownerdir) {
+		// One list file per owner may need a lot of descriptors.
+		struct rlimit rl;
+		if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+			rl.rlim_cur = rl.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &rl);
+		}
+		if (stat(ownerdir, &sb) == -1 || !(S_ISDIR(sb.st_mode))) {
+			fprintf(stderr, "%s is not a directory!\n", ownerdir);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// before any threads start, they only inherit the priorities
+	throttleinit(maxrate, adaptive);
+	if (migrateto) {
+		char archive[PATH_MAX];
+		dorealpath(migrateto, archive);
+		if (scanbelowroots(archive)) {
+			fprintf(stderr, "%s is inside the directories being"
+						" searched\n", migrateto);
+			exit(EXIT_FAILURE);
+		}
+		migrateinit(archive, migratejobs);
+	}
+	if (resume && !(cpfn)) {
+		fprintf(stderr, "--resume needs a --checkpoint file\n");
+		dohelp(1);
+	}
 
     fileage = cutofftimebyage(age, aunit);
-    recursedir(topdir);
+    if (stream && compress) {
+		// before cpopen(), replayed matches go to the stream too
+		cw = cwopen(stdout, compress[0] ? compress : NULL, compressjobs);
+	}
+    if (cpfn) cpopen(cpfn, resume, &fileage, replayold);
+    if (linkgroups) {
+		char raw[PATH_MAX + 4];
+		sprintf(raw, "%s.raw", linkgroups);
+		fplinks = dofopen(raw, "w");
+	}
+    scanaddvisitor(&oldvisitor);
+    scanrun();
+    if (migrateto) migratefinish(quiet);
+    if (cpfn) cpflush();
+    if (byowner) linkforeach(partlink, NULL);
+    if (linkgroups) writelinkgroups();
     fclose(fpo);
-    if (oldcount > 0) {
-		sprintf(command, "sort -u %s > %s", workfile[0],
-					workfile[1]);
-		dosystem(command);
-	} else {
+    if (stream) {
+		unlink(workfile[0]);
+		if (cw) cwclose(cw);
+		if (!(oldcount > 0) && !(quiet)) {
+			fprintf(stderr, "No old files found\n");
+		}
+		if (byowner) writeowners();
+		return 0;
+	}
+    if (!(oldcount > 0)) {
 		if (!quiet) {
 			fprintf(stderr, "No old files found\n");
 		}
 		unlink(workfile[0]);
 		exit(EXIT_SUCCESS);
 	}
-	// get rid of the leading inode and sort on pathname
-	stripinode(workfile[1], workfile[2]);
-	sprintf(command, "sort %s > %s", workfile[2],
-					workfile[3]);
-	dosystem(command);
-	dumpfile(workfile[3], stdout);
+	sortlist(workfile[0], workfile[1], workfile[2], workfile[3]);
+	if (compress) {
+		struct cwriter *cw = cwopen(stdout, compress[0] ? compress : NULL,
+										compressjobs);
+		cwdumpfile(workfile[3], cw);
+		cwclose(cw);
+	} else {
+		dumpfile(workfile[3], stdout);
+	}
+	if (byowner) writeowners();
 
     return 0;
 }//main()
@@ -230,253 +492,325 @@ struct listitem *insertbefore(char *name, struct listitem *head)
     return li;
 } // insertbefore()
 
-time_t cutofftimebyage(int age, char aunit)
-{
-    // Calculate the file selection date
-    time_t fileage;
-    struct tm *fatm;
-
-    fileage = time(NULL);
-    fatm = localtime(&fileage);
-    // printf("Time is: %s\n", asctime(fatm));
-    switch (aunit) {
-        case 'Y':
-            fatm->tm_year -= age;
-        break;
-        case 'M':
-        /*
-            tmp = age / 12;
-            fatm->tm_year -= tmp;
-            tmp = age % 12;
-            if (tmp < fatm->tm_mon) {
-                fatm->tm_mon -= tmp;
-            } else {
-                tmp = 12 - tmp;
-                fatm->tm_year--;
-                fatm->tm_mon += tmp;
-            }
-        */
-            fatm->tm_mon -= age;
-        break;
-        case 'D':
-            fatm->tm_mday -= age;
-        break;
-    }
-    return mktime(fatm);
-} // cutofftimebyage()
-
-time_t parsetimestring(const char *timestr)
-{
-   /*
-    * check the string in dts for valid values
-    * and return the time if all ok;
-   */
-   char dts[16];
-   struct tm dt;
-
-   // seconds will never be set here, also minutes & hours may not be.
-   dt.tm_sec = 0;
-   dt.tm_min = 0;
-   dt.tm_hour = 0;
-   dt.tm_wday = 0;
-   dt.tm_yday = 0;
-
-   strcpy(dts, timestr);
-   switch(strlen(dts)) {
-        case 12:
-            dt.tm_min = atoi(&dts[10]);
-            if ((dt.tm_min < 0 ) || (dt.tm_min > 59)) {
-                fprintf(stderr, "Illegal value for minutes: %d\n",
-                        dt.tm_min);
-                dohelp(1);
-            }
-            dts[10] = '\0';
-        case 10:
-            dt.tm_hour = atoi(&dts[8]);
-            if ((dt.tm_hour < 0 ) || (dt.tm_hour > 23)) {
-                fprintf(stderr, "Illegal value for hours: %d\n",
-                        dt.tm_hour);
-                dohelp(1);
-            }
-            dts[8] = '\0';
-        case 8:
-            dt.tm_mday = atoi(&dts[6]);
-            if ((dt.tm_mday < 1 ) || (dt.tm_mday > 31)) { // rough enough for now
-                fprintf(stderr, "Illegal value for days: %d\n",
-                        dt.tm_mday);
-                dohelp(1);
-            }
-            dts[6] = '\0';
-            dt.tm_mon = atoi(&dts[4]) - 1;
-            if ((dt.tm_mon < 0 ) || (dt.tm_mon > 11)) {
-                fprintf(stderr, "Illegal value for months: %d\n",
-                        dt.tm_mon+1);
-                dohelp(1);
-            }
-            dts[4] = '\0';
-
-            dt.tm_year = atoi(dts) - 1900;
-        break;
-        default:
-        fprintf(stderr, "%s is not formatted correctly\n", dts);
-        dohelp(1);
-        break;
-        // now test if our days are valid for the month
-    } // switch()
-
-
-    if (!(validday(dt.tm_year+1900, dt.tm_mon+1, dt.tm_mday))) {
-        fprintf(stderr, "For the year %d, month %d, %d"
-                        " days is invalid\n",
-                        dt.tm_year+1900, dt.tm_mon+1, dt.tm_mday);
-        exit(EXIT_FAILURE);
-    }
-    return mktime(&dt);
-} // parsetimestring()
-
-int validday(int yy, int mon, int dd)
-{
-    int daysinmonth[13] = {0,31,28,31,30,31,30,31,31,30,31,30,31};
-    if (mon == 2) {
-        daysinmonth[2] += leapyear(yy);
-    }
-    if (dd <= daysinmonth[mon]) return 1;
-    return 0;
-} // validday()
-
-int leapyear(int yy)
-{
-    if (yy % 4 != 0) return 0;
-    if (yy % 400 == 0) return 1;
-    if (yy % 100 == 0) return 0;
-    return 1; // yy % 4 == 0
-} // leapyear()
+int oldenterdir(const char *path, void **dirdata, void *ctx)
+{	/* On resume, finished trees are skipped and finished dirs are only
+	 * read for their sub dirs. Otherwise the dir gets a buffer for the
+	 * journal records of its old files. */
+	(void)ctx;
+	if (cpfn && resume) {
+		if (cpsubtreedone(path)) return SCAN_SKIP;
+		if (cpdirdone(path)) return SCAN_DIRSONLY;
+	}
+	if (cpfn) {
+		struct cpbuf *cb = domalloc(sizeof(struct cpbuf));
+		cb->buf = NULL;
+		cb->len = cb->size = 0;
+		*dirdata = cb;
+	}
+	return SCAN_ALL;
+} // oldenterdir()
 
-void recursedir(char *path)
+void oldvisit(const struct scanentry *e, void *dirdata, void *ctx)
 {
     /*
      * Output a list of old files if such exist
     */
-    struct dirent *de;
-    DIR *dp;
+	struct cpbuf *cb = dirdata;
+	struct stat sb;
+	time_t thisfiletime;
+
+	(void)ctx;
+	if (e->type != DT_REG && e->type != DT_LNK) return;
+	/* symlink processing.
+	 I once did have separate processing for errors ELOOP
+	 and ENOENT but circular links are simply reported as
+	 ENOENT along with missing links. So I'll just let perror
+	 take care of it all. */
+	if (!(e->stx)) {
+		errno = e->staterr;
+		perror(e->path);   // just note the error, don't abort.
+		return;
+	}
+	statxtostat(e->stx, &sb);
+	// do the file m time check
+	thisfiletime = sb.st_mtime;
+	if (thisfiletime >= fileage) return;
+
+	if (e->type == DT_REG) {
+		// report the thing, other names of it don't count again
+		foundold(cb, e->path, &sb, !(e->linkseen));
+		if (fplinks && sb.st_nlink > 1) reportlink(e->path, &sb);
+		if (migrateto) migratefile(e->path, &sb);
+	} else {
+		/* stat() gives me times applicable to the target not the
+		 link, but unlink() will remove the link, not the target.
+		 That much is fine because, if old, I want to remove the
+		 link as well as the target. */
+
+		/* NB if link or links are within the given search dir,
+		 * the target will be reported more than once. Sort -u
+		 * will take care of such happenings.*/
+
+		char target[PATH_MAX];
+		// report the symlink
+		foundold(cb, e->path, &sb, 0);
+		// Dealt with the link, now report the target of the link
+		dorealpath(e->path, target);
+		// only tally it here if the walk won't find it too.
+		foundold(cb, target, &sb, !(scanbelowroots(target)));
+	}
+} // oldvisit()
 
-    dp = opendir(path);
-    if (!(dp)) {
-        perror(path);
-        exit(EXIT_FAILURE);
-    }
-    while ((de = readdir(dp))) {
-        time_t thisfiletime;
-        struct stat sb;
-        char newpath[PATH_MAX];
-        if (strcmp(de->d_name, ".") == 0) continue;
-        if (strcmp(de->d_name, "..") == 0) continue;
-        strcpy(newpath, path);
-        if (newpath[strlen(newpath)-1] != '/') strcat(newpath, "/");
-        switch (de->d_type) {
-            case DT_DIR:
-            // process this dir
-            strcat(newpath, de->d_name);
-            recursedir(newpath);
-            break;
-            case DT_REG:
-            strcat(newpath, de->d_name);
-            if (stat(newpath, &sb) == -1) {
-                perror(newpath);   // just note the error, don't abort.
-                break;
-            }
-            // do the file m time check
-            thisfiletime = sb.st_mtime;
-            if (thisfiletime < fileage) {
-				// report the thing
-                fprintf(fpo, "%.16lx %s%s %s" ,sb.st_ino, newpath,
-					pathend, asctime(localtime(&thisfiletime)));
-				oldcount++;
-            }
-            break;
-            case DT_LNK:
-            /* symlink processing.
-             I once did have separate processing for errors ELOOP
-             and ENOENT but circular links are simply reported as
-             ENOENT along with missing links. So I'll just let perror
-             take care of it all. */
-
-			/* stat() gives me times applicable to the target not the
-			 link, but unlink() will remove the link, not the target.
-			 That much is fine because, if old, I want to remove the
-			 link as well as the target. */
-
-            if (stat(newpath, &sb) == -1) {
-                perror(newpath);   // just note the error, don't abort.
-                break;
-			}
-            // do the file m time check
-            thisfiletime = sb.st_mtime;
-            if (thisfiletime < fileage) {
-				/* NB if link or links are within the given search dir,
-				 * the target will be reported more than once. Sort -u
-				 * will take care of such happenings.*/
-
-				char target[PATH_MAX];
-                // report the symlink
-                fprintf(fpo, "%.16lx %s%s %s" ,sb.st_ino, newpath, pathend,
-                            asctime(localtime(&thisfiletime)) );
-                 oldcount++;
-				// Dealt with the link, now report the target of the link
-				dorealpath(newpath, target);
-				fprintf(fpo, "%.16lx %s%s %s" ,sb.st_ino, target, pathend,
-                            asctime(localtime(&thisfiletime)) );
-                 oldcount++;
-            }
-            break;
-
-           default:
-            continue;   // ignore all other d_types
-            break;
+void oldleavedir(const char *path, void *dirdata, void *ctx)
+{	// the dir's old files go to the journal along with its D record.
+	struct cpbuf *cb = dirdata;
 
+	(void)ctx;
+	if (!(cb)) return;
+	cpcommit(cb, path);
+	free(cb->buf);
+	free(cb);
+} // oldleavedir()
 
+void oldsubtreedone(const char *path, void *ctx)
+{
+	(void)ctx;
+	if (cpfn) cpsubtree(path);
+} // oldsubtreedone()
+
+void foundold(struct cpbuf *cb, const char *path, const struct stat *sb,
+				int tally)
+{	// report an old file and hold it for the journal.
+	reportold(path, sb, tally);
+	if (cpfn) cpaddmatch(cb, path, sb, tally);
+} // foundold()
+
+void replayold(const char *path, const struct stat *sb, int tally)
+{	/* a match from the checkpoint journal. If migrating, a file found
+	 * by the walk itself that is still in place was not moved before
+	 * the interruption so queue it again. */
+	struct stat now;
+
+	reportold(path, sb, tally);
+	if (!(migrateto) || !(scanbelowroots(path))) return;
+	if (lstat(path, &now) == 0 && S_ISREG(now.st_mode) &&
+			now.st_ino == sb->st_ino && now.st_mtime == sb->st_mtime) {
+		migratefile(path, &now);
+	}
+} // replayold()
+
+void reportold(const char *path, const struct stat *sb, int tally)
+{	/* write one line of the work file, workers share fpo. When tally
+	 * is set the file is counted against its owner, a symlink and its
+	 * target are the one file so only one of them is tallied. */
+	struct tm tm;
+	char when[32];
+	struct owner *ow;
+
+	localtime_r(&sb->st_mtime, &tm);
+	asctime_r(&tm, when);
+	pthread_mutex_lock(&outlock);
+	if (!(stream)) {
+		fprintf(fpo, "%.16lx %s%s %s", sb->st_ino, path, pathend, when);
+	} else if (cw) {
+		char line[PATH_MAX + 64];
+		int n = snprintf(line, sizeof(line), "%s%s %s", path, pathend,
+							when);
+		cwwrite(cw, line, n);
+	} else {
+		fprintf(stdout, "%s%s %s", path, pathend, when);
+	}
+	oldcount++;
+	pthread_mutex_unlock(&outlock);
+	if (!(byowner)) return;
+
+	ow = findowner(sb->st_uid, (byowner == 2) ? sb->st_gid : (gid_t)-1);
+	pthread_mutex_lock(&ow->lock);
+	if (tally) {
+		ow->count++;
+		ow->bytes += sb->st_size;
+		ow->reclaim += sb->st_size;
+	}
+	if (ow->fpl) {
+		fprintf(ow->fpl, "%.16lx %s%s %s", sb->st_ino, path, pathend,
+					when);
+	}
+	pthread_mutex_unlock(&ow->lock);
+} // reportold()
+
+void reportlink(const char *path, const struct stat *sb)
+{	// one name of a hard linked file, keyed so sort groups them.
+	pthread_mutex_lock(&outlock);
+	fprintf(fplinks, "%.16lx%.16lx %s\n", (unsigned long)sb->st_dev,
+				(unsigned long)sb->st_ino, path);
+	pthread_mutex_unlock(&outlock);
+} // reportlink()
+
+void partlink(dev_t dev, const struct statx *stx, unsigned seen,
+				void *ctx)
+{	/* An old file with names the walk didn't find, deleting the ones
+	 * that were found frees nothing. */
+	struct owner *ow;
+
+	(void)dev;
+	(void)ctx;
+	if (seen >= stx->stx_nlink) return;
+	if (stx->stx_mtime.tv_sec >= fileage) return;
+	ow = findowner(stx->stx_uid,
+					(byowner == 2) ? stx->stx_gid : (gid_t)-1);
+	pthread_mutex_lock(&ow->lock);
+	ow->reclaim -= stx->stx_size;
+	pthread_mutex_unlock(&ow->lock);
+} // partlink()
+
+void writelinkgroups(void)
+{	/* Sort the names on device and inode then write each file as a
+	 * line saying how many of its names were found and how big it is,
+	 * followed by the names and a blank line. */
+	FILE *fpi, *fpg;
+	char raw[PATH_MAX + 4], sorted[PATH_MAX + 4];
+	char command[3 * PATH_MAX];
+	char line[PATH_MAX + 40];
+	char key[33] = "";
+	struct statx stx;
+	unsigned long dev, ino;
+	unsigned seen;
+	char *eol;
+
+	fclose(fplinks);
+	sprintf(raw, "%s.raw", linkgroups);
+	sprintf(sorted, "%s.s", linkgroups);
+	sprintf(command, "sort -u '%s' > '%s'", raw, sorted);
+	dosystem(command);
+	fpi = dofopen(sorted, "r");
+	fpg = dofopen(linkgroups, "w");
+	while (fgets(line, sizeof(line), fpi)) {
+		eol = strchr(line, '\n');
+		if (eol) *eol = 0;
+		if (strncmp(line, key, 32) != 0) {
+			if (key[0]) fputc('\n', fpg);
+			strncpy(key, line, 32);
+			key[32] = 0;
+			sscanf(key, "%16lx%16lx", &dev, &ino);
+			if (linkget(dev, ino, &stx, &seen)) {
+				fprintf(fpg, "%u:%u %lu %u of %u names %llu bytes\n",
+						major(dev), minor(dev), ino, seen,
+						stx.stx_nlink,
+						(unsigned long long)stx.stx_size);
+			} else {
+				fprintf(fpg, "%u:%u %lu\n", major(dev), minor(dev), ino);
+			}
 		}
+		fprintf(fpg, "%s\n", line + 33);
 	}
-    closedir(dp);
-} // recursedir()
-
-void dorealpath(char *givenpath, char *resolvedpath)
-{	// realpath() witherror handling.
-	if(!(realpath(givenpath, resolvedpath))) {
-		perror("realpath()");
-		exit(EXIT_FAILURE);
+	fclose(fpi);
+	fclose(fpg);
+	unlink(raw);
+	unlink(sorted);
+} // writelinkgroups()
+
+struct owner *findowner(uid_t uid, gid_t gid)
+{	// get the bucket for uid/gid, making it on first sight.
+	struct owner *ow;
+	struct passwd pw, *pwp;
+	struct group gr, *grp;
+	char buf[4096];
+	char name[PATH_MAX];
+	char fn[PATH_MAX];
+	unsigned h = (uid * 31 + gid) % OWNERHASH;
+
+	pthread_mutex_lock(&ownerlock);
+	for (ow = owners[h]; ow; ow = ow->next) {
+		if (ow->uid == uid && ow->gid == gid) {
+			pthread_mutex_unlock(&ownerlock);
+			return ow;
+		}
 	}
-} // dorealpath()
-
-void dosystem(const char *cmd)
+	if (getpwuid_r(uid, &pw, buf, sizeof(buf), &pwp) == 0 && pwp) {
+		strcpy(name, pw.pw_name);
+	} else {
+		sprintf(name, "%lu", (unsigned long)uid);
+	}
+	if (gid != (gid_t)-1) {
+		if (getgrgid_r(gid, &gr, buf, sizeof(buf), &grp) == 0 && grp) {
+			sprintf(name + strlen(name), ".%s", gr.gr_name);
+		} else {
+			sprintf(name + strlen(name), ".%lu", (unsigned long)gid);
+		}
+	}
+	ow = domalloc(sizeof(struct owner));
+	ow->uid = uid;
+	ow->gid = gid;
+	ow->name = dostrdup(name);
+	ow->count = 0;
+	ow->bytes = 0;
+	ow->reclaim = 0;
+	ow->fpl = (FILE *)NULL;
+	ow->listfn = (char *)NULL;
+	if (ownerdir) {
+		sprintf(fn, "%s-%s.raw", ownertmp, name);
+		ow->listfn = dostrdup(fn);
+		ow->fpl = dofopen(fn, "w");
+		// big buffers, these get written a line at a time.
+		setvbuf(ow->fpl, NULL, _IOFBF, 65536);
+	}
+	pthread_mutex_init(&ow->lock, NULL);
+	ow->next = owners[h];
+	owners[h] = ow;
+	nowners++;
+	pthread_mutex_unlock(&ownerlock);
+	return ow;
+} // findowner()
+
+int cmpowner(const void *a, const void *b)
 {
-    const int status = system(cmd);
-
-    if (status == -1) {
-        fprintf(stderr, "system to execute: %s\n", cmd);
-        exit(EXIT_FAILURE);
-    }
-
-    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
-        fprintf(stderr, "%s failed with non-zero exit\n", cmd);
-        exit(EXIT_FAILURE);
-    }
-
-    return;
-} // dosystem()
+	const struct owner *oa = *(struct owner * const *)a;
+	const struct owner *ob = *(struct owner * const *)b;
+	return strcmp(oa->name, ob->name);
+} // cmpowner()
+
+void writeowners(void)
+{	/* Summary of count and bytes per owner, to dir/summary with -O
+	 * else stderr. With -O also finish each owner's list the same way
+	 * as the main list. */
+	struct owner **all;
+	struct owner *ow;
+	FILE *fps;
+	char fn[PATH_MAX], tmp1[PATH_MAX + 2], tmp2[PATH_MAX + 2];
+	int h, i;
+
+	all = domalloc(sizeof(struct owner *) * (nowners + 1));
+	i = 0;
+	for (h = 0; h < OWNERHASH; h++) {
+		for (ow = owners[h]; ow; ow = ow->next) all[i++] = ow;
+	}
+	qsort(all, nowners, sizeof(struct owner *), cmpowner);
 
-char *dostrdup(const char *s)
-{
-	/*
-	 * strdup() with in built error handling
-	*/
-	char *cp = strdup(s);
-	if(!(cp)) {
-		perror(s);
-		exit(EXIT_FAILURE);
+	if (ownerdir) {
+		sprintf(fn, "%s/summary", ownerdir);
+		fps = dofopen(fn, "w");
+	} else {
+		fps = stderr;
+	}
+	fprintf(fps, "%-24s %10s %16s %16s\n", "owner", "files", "bytes",
+				"reclaimable");
+	for (i = 0; i < nowners; i++) {
+		ow = all[i];
+		fprintf(fps, "%-24s %10ld %16lld %16lld\n", ow->name, ow->count,
+					ow->bytes, ow->reclaim);
+		if (!(ow->fpl)) continue;
+		fclose(ow->fpl);
+		sprintf(fn, "%s/%s.list", ownerdir, ow->name);
+		sprintf(tmp1, "%s-%s.u", ownertmp, ow->name);
+		sprintf(tmp2, "%s-%s.s", ownertmp, ow->name);
+		sortlist(ow->listfn, tmp1, tmp2, fn);
+		unlink(ow->listfn);
+		unlink(tmp1);
+		unlink(tmp2);
 	}
-	return cp;
-} // dostrdup()
+	if (fps != stderr) fclose(fps);
+	free(all);
+} // writeowners()
 
 char** workfiles(const char *dir, const char *progname, int numfiles)
 {
@@ -502,31 +836,3 @@ char** workfiles(const char *dir, const char *progname, int numfiles)
 	return workfile;
 } // worfiles()
 
-static void* domalloc(size_t thesize)
-{	// malloc() with error handling
-	void *ptr = malloc(thesize);
-	if (!(ptr)) {
-		perror("malloc()");
-		exit(EXIT_FAILURE);
-	}
-	return ptr;
-}
-
-void stripinode(const char *fnamein, const char *fnameout)
-{
-	FILE *fpo;
-	struct fdata fdat;
-	char *bol, *eol;
-
-	fpo = dofopen(fnameout, "w");
-	fdat = readfile(fnamein, 0, 1);
-	bol = fdat.from +17;
-	while(bol < fdat.to) {
-		eol = memchr(bol, '\n', PATH_MAX);
-		fwrite(bol, 1, eol-bol+1, fpo);
-		bol = eol + 18;
-	} // while()
-	fclose(fpo);
-	free (fdat.from);
-} // stripinode()
-
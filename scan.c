@@ -0,0 +1,526 @@
+/*      scan.c
+ *
+ *	Copyright 2015 Bob Parker <rlp1938@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *	MA 02110-1301, USA.
+*/
+
+/*
+ * The directory walk shared by the cleanup programs. Every entry is
+ * read and stat'ed once and offered to each of the registered visitors,
+ * so one pass can feed several reports.
+ *
+ * Each device found under the roots gets its own queue of directories
+ * and its own set of workers, so independent disks are scanned in
+ * parallel while any one disk only sees maxworkers readers.
+*/
+
+#include "scan.h"
+#include "fileutil.h"
+#include "throttle.h"
+#include "links.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/sysmacros.h>
+
+struct scannode {
+	char *dirname;
+	struct scannode *next;	// in the device queue
+	struct scannode *parent;	// dir this one was found in
+	int refs;	// 1 for itself plus 1 per unfinished sub dir
+	unsigned skipping;	// bit per visitor that said SCAN_SKIP above
+};
+
+struct devgroup {
+	dev_t dev;
+	int maxworkers;
+	pthread_t *worker;
+	struct scannode *queue;	// dirs waiting to be scanned
+	pthread_cond_t wake;
+	struct throttle *throttle;	// this device's adaptive delay
+	struct devgroup *next;
+};
+
+struct devlimit {
+	dev_t dev;
+	int jobs;
+	struct devlimit *next;
+};
+
+static struct scanvisitor *visitors[SCANMAXVISITORS];
+static int nvisitors;
+static unsigned int statmask;
+static struct devgroup *devgroups;
+static struct devlimit *devlimits;
+static char **roots;
+static int nroots;
+static int jobs = 1;
+static int pending;	// dirs queued or being scanned on all devices
+static pthread_mutex_t scanlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scandone = PTHREAD_COND_INITIALIZER;
+
+static void recursedir(struct devgroup *dg, struct scannode *dir);
+static void queuedir(const char *path, dev_t dev,
+						struct scannode *parent, unsigned skipping);
+static struct scannode *finishdir(struct scannode *dir);
+static void subtreesdone(struct scannode *done);
+static struct devgroup *finddevgroup(dev_t dev);
+static void *scanworker(void *arg);
+static int timedstatx(struct devgroup *dg, int dirfd, const char *name,
+						int flags, struct statx *stx);
+
+void scansetjobs(int n)
+{	// workers per device unless scandevlimit() says otherwise.
+	jobs = n;
+} // scansetjobs()
+
+void scandevlimit(const char *spec)
+{	// spec is path=N, limit the workers on the device holding path.
+	char path[PATH_MAX];
+	char *eq;
+	struct stat sb;
+	struct devlimit *dl;
+
+	strcpy(path, spec);
+	eq = strrchr(path, '=');
+	if (!(eq)) {
+		fprintf(stderr, "%s is not of the form path=N\n", spec);
+		exit(EXIT_FAILURE);
+	}
+	*eq = '\0';
+	if (stat(path, &sb) == -1) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	dl = domalloc(sizeof(struct devlimit));
+	dl->dev = sb.st_dev;
+	dl->jobs = strtol(eq + 1, NULL, 10);
+	if (dl->jobs < 1) {
+		fprintf(stderr, "Illegal value for jobs: %s\n", eq + 1);
+		exit(EXIT_FAILURE);
+	}
+	dl->next = devlimits;
+	devlimits = dl;
+} // scandevlimit()
+
+void scanaddvisitor(struct scanvisitor *sv)
+{
+	if (nvisitors == SCANMAXVISITORS) {
+		fprintf(stderr, "Too many scan visitors\n");
+		exit(EXIT_FAILURE);
+	}
+	visitors[nvisitors++] = sv;
+	statmask |= sv->statmask;
+} // scanaddvisitor()
+
+void scanaddroot(const char *path)
+{	// add a top directory to scan, relative paths are made absolute.
+	char topdir[PATH_MAX];
+	struct stat sb;
+
+	// Check that the top dir is legitimate.
+	if (stat(path, &sb) == -1) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	// It exists then, but is it a dir?
+	if (!(S_ISDIR(sb.st_mode))) {
+		fprintf(stderr, "%s is not a directory!\n", path);
+		exit(EXIT_FAILURE);
+	}
+	// Convert relative path to absolute if needed.
+	if (path[0] != '/') {
+		dorealpath(path, topdir);
+	} else {
+		strcpy(topdir, path);
+	}
+	roots = realloc(roots, sizeof(char *) * (nroots + 1));
+	if (!(roots)) {
+		perror("realloc()");
+		exit(EXIT_FAILURE);
+	}
+	roots[nroots++] = dostrdup(topdir);
+} // scanaddroot()
+
+void scanrun(void)
+{	/* Queue every root on its own device then wait for the lot.
+	 * A root lying inside another root is dropped, the outer one
+	 * will get to it anyway. */
+	struct stat sb;
+	struct devgroup *dg;
+	int i, j, nested;
+
+	pthread_mutex_lock(&scanlock);
+	pending++;	// hold off the workers until all roots are queued
+	pthread_mutex_unlock(&scanlock);
+	for (i = 0; i < nroots; i++) {
+		nested = 0;
+		for (j = 0; j < nroots; j++) {
+			if (j == i) continue;
+			if (isbelow(roots[i], roots[j])) {
+				// of identical roots keep only the first.
+				if (strcmp(roots[i], roots[j]) || j < i) nested = 1;
+			}
+		}
+		if (nested) continue;
+		if (stat(roots[i], &sb) == -1) {
+			perror(roots[i]);
+			exit(EXIT_FAILURE);
+		}
+		queuedir(roots[i], sb.st_dev, (struct scannode *)NULL, 0);
+	} // for()
+
+	pthread_mutex_lock(&scanlock);
+	pending--;
+	if (!(pending)) {
+		for (dg = devgroups; dg; dg = dg->next) {
+			pthread_cond_broadcast(&dg->wake);
+		}
+	}
+	while (pending) pthread_cond_wait(&scandone, &scanlock);
+	pthread_mutex_unlock(&scanlock);
+
+	// No worker can create a device group once pending is 0.
+	for (dg = devgroups; dg; dg = dg->next) {
+		for (i = 0; i < dg->maxworkers; i++) {
+			pthread_join(dg->worker[i], NULL);
+		}
+	}
+} // scanrun()
+
+void recursedir(struct devgroup *dg, struct scannode *dir)
+{
+    /*
+     * Offer each entry of dir to the visitors. Sub directories are
+     * put on the device queue for whichever worker is free next.
+    */
+    struct dirent *de;
+    DIR *dp;
+    struct stat dsb;
+    char *path = dir->dirname;
+    struct timespec ts;
+    void *dirdata[SCANMAXVISITORS];
+    unsigned visiting = 0;	// bit per visitor wanting this dir's entries
+    unsigned skipping = dir->skipping;
+    unsigned int mask = 0;
+    int linking;
+    int i;
+
+    throttlestart(dg->throttle, &ts);
+    dp = opendir(path);
+    if (!(dp)) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    if (fstat(dirfd(dp), &dsb) == -1) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    if (dsb.st_dev != dg->dev) {
+		// A mount point, let that device's own workers have it.
+		closedir(dp);
+		queuedir(path, dsb.st_dev, dir, skipping);
+		return;
+	}
+	for (i = 0; i < nvisitors; i++) {
+		dirdata[i] = NULL;
+		if (skipping & (1u << i)) continue;
+		switch (visitors[i]->enterdir ?
+				visitors[i]->enterdir(path, &dirdata[i], visitors[i]->ctx)
+				: SCAN_ALL) {
+			case SCAN_ALL:
+			visiting |= 1u << i;
+			mask |= visitors[i]->statmask;
+			break;
+			case SCAN_SKIP:
+			skipping |= 1u << i;
+			break;
+		}
+	}
+	// and no subtreedone() for those that said SCAN_SKIP
+	dir->skipping = skipping;
+	if (skipping == (1u << nvisitors) - 1) {
+		// nobody wants anything here or below
+		closedir(dp);
+		return;
+	}
+
+    // hard links are only tracked for visitors that can tell them apart
+    linking = (mask & (STATX_NLINK | STATX_INO)) ==
+				(STATX_NLINK | STATX_INO);
+    de = readdir(dp);	// the first getdents() is the one worth timing
+    throttleend(dg->throttle, &ts);
+    for (; de; de = readdir(dp)) {
+        struct scanentry se;
+        struct statx stx;
+        char newpath[PATH_MAX];
+        if (strcmp(de->d_name, ".") == 0) continue;
+        if (strcmp(de->d_name, "..") == 0) continue;
+        strcpy(newpath, path);
+        if (newpath[strlen(newpath)-1] != '/') strcat(newpath, "/");
+        strcat(newpath, de->d_name);
+        se.dirfd = dirfd(dp);
+        se.dirpath = path;
+        se.name = de->d_name;
+        se.path = newpath;
+        se.type = de->d_type;
+        se.stx = NULL;
+        se.staterr = 0;
+        se.linkseen = 0;
+        if (se.type == DT_UNKNOWN) {
+			// some file systems don't fill d_type in, ask the inode.
+			if (timedstatx(dg, se.dirfd, se.name, AT_SYMLINK_NOFOLLOW,
+							&stx) == -1) {
+				perror(newpath);
+				continue;
+			}
+			se.type = IFTODT(stx.stx_mode);
+			if (se.type != DT_LNK && se.type != DT_DIR) se.stx = &stx;
+		}
+        if (se.type == DT_DIR) {
+            queuedir(newpath, dg->dev, dir, skipping);
+            continue;
+		}
+		if (!(visiting)) continue;
+		if (linking && se.type == DT_REG && !(se.stx) &&
+				linkfind(dg->dev, de->d_ino, &stx, &se.linkseen)) {
+			// another name of a file already stat'ed
+			se.stx = &stx;
+		} else {
+			if (mask && !(se.stx)) {
+				/* stat() gives me times applicable to the target not
+				 the link, which is what the visitors want. A link that
+				 can't be followed is broken or circular. */
+				if (timedstatx(dg, se.dirfd, se.name, 0, &stx) == -1) {
+					se.staterr = errno;
+				} else {
+					se.stx = &stx;
+				}
+			}
+			/* Remember files with other names, so long as d_ino can
+			 be trusted to find them again. */
+			if (linking && se.type == DT_REG && se.stx &&
+					stx.stx_nlink > 1 && stx.stx_ino == de->d_ino) {
+				se.linkseen = linkadd(dg->dev, &stx);
+			}
+		}
+		for (i = 0; i < nvisitors; i++) {
+			if (!(visiting & (1u << i)) || !(visitors[i]->visit)) continue;
+			visitors[i]->visit(&se, dirdata[i], visitors[i]->ctx);
+		}
+	}
+    closedir(dp);
+	for (i = 0; i < nvisitors; i++) {
+		if (!(visiting & (1u << i)) || !(visitors[i]->leavedir)) continue;
+		visitors[i]->leavedir(path, dirdata[i], visitors[i]->ctx);
+	}
+} // recursedir()
+
+int timedstatx(struct devgroup *dg, int dirfd, const char *name,
+				int flags, struct statx *stx)
+{	// statx() under dg's throttle.
+	struct timespec ts;
+	int ret;
+
+	throttlestart(dg->throttle, &ts);
+	ret = statx(dirfd, name, flags, statmask ? statmask : STATX_TYPE, stx);
+	throttleend(dg->throttle, &ts);
+	return ret;
+} // timedstatx()
+
+struct devgroup *finddevgroup(dev_t dev)
+{	// get the group for dev, creating it and its workers if new.
+	// Caller holds scanlock.
+	struct devgroup *dg;
+	struct devlimit *dl;
+	int i;
+
+	for (dg = devgroups; dg; dg = dg->next) {
+		if (dg->dev == dev) return dg;
+	}
+	dg = domalloc(sizeof(struct devgroup));
+	dg->dev = dev;
+	dg->maxworkers = jobs;
+	for (dl = devlimits; dl; dl = dl->next) {
+		if (dl->dev == dev) dg->maxworkers = dl->jobs;
+	}
+	dg->queue = (struct scannode *)NULL;
+	pthread_cond_init(&dg->wake, NULL);
+	dg->throttle = throttlenew();
+	dg->worker = domalloc(sizeof(pthread_t) * dg->maxworkers);
+	for (i = 0; i < dg->maxworkers; i++) {
+		errno = pthread_create(&dg->worker[i], NULL, scanworker, dg);
+		if (errno) {
+			perror("pthread_create()");
+			exit(EXIT_FAILURE);
+		}
+	}
+	dg->next = devgroups;
+	devgroups = dg;
+	return dg;
+} // finddevgroup()
+
+void queuedir(const char *path, dev_t dev, struct scannode *parent,
+				unsigned skipping)
+{	// hand a directory to the workers for dev.
+	struct devgroup *dg;
+	struct scannode *sn = domalloc(sizeof(struct scannode));
+
+	sn->dirname = dostrdup(path);
+	sn->parent = parent;
+	sn->refs = 1;
+	sn->skipping = skipping;
+	pthread_mutex_lock(&scanlock);
+	dg = finddevgroup(dev);
+	sn->next = dg->queue;
+	dg->queue = sn;
+	if (parent) parent->refs++;
+	pending++;
+	pthread_cond_signal(&dg->wake);
+	pthread_mutex_unlock(&scanlock);
+} // queuedir()
+
+void *scanworker(void *arg)
+{	/* Take directories off this device's queue until every device
+	 * has run dry. A dir being scanned can still queue more work so
+	 * an empty queue alone does not mean we are finished. */
+	struct devgroup *dg = arg;
+	struct devgroup *each;
+	struct scannode *sn, *done;
+
+	pthread_mutex_lock(&scanlock);
+	for (;;) {
+		while (!(dg->queue) && pending) {
+			pthread_cond_wait(&dg->wake, &scanlock);
+		}
+		if (!(dg->queue)) break;	// pending is 0, all done.
+		sn = dg->queue;
+		dg->queue = sn->next;
+		pthread_mutex_unlock(&scanlock);
+
+		recursedir(dg, sn);
+
+		pthread_mutex_lock(&scanlock);
+		done = finishdir(sn);
+		if (done) {
+			// tell the visitors without holding up the other workers
+			pthread_mutex_unlock(&scanlock);
+			subtreesdone(done);
+			pthread_mutex_lock(&scanlock);
+		}
+		pending--;
+		if (!(pending)) {
+			for (each = devgroups; each; each = each->next) {
+				pthread_cond_broadcast(&each->wake);
+			}
+			pthread_cond_signal(&scandone);
+		}
+	}
+	pthread_mutex_unlock(&scanlock);
+	return NULL;
+} // scanworker()
+
+struct scannode *finishdir(struct scannode *dir)
+{	/* dir has been read, drop its own reference. Once a dir and all
+	 * below it are done so is its parent's reference to it. Returns
+	 * the dirs now done, deepest first, for subtreesdone().
+	 * Caller holds scanlock. */
+	struct scannode *done = NULL, **tail = &done;
+
+	dir->refs--;
+	while (dir && !(dir->refs)) {
+		*tail = dir;
+		tail = &dir->next;	// next is free once off the queue
+		dir = dir->parent;
+		if (dir) dir->refs--;
+	}
+	*tail = NULL;
+	return done;
+} // finishdir()
+
+void subtreesdone(struct scannode *done)
+{	// tell the visitors of dirs finished by finishdir() and free them.
+	struct scannode *next;
+	int i;
+
+	for (; done; done = next) {
+		for (i = 0; i < nvisitors; i++) {
+			if (done->skipping & (1u << i)) continue;
+			if (visitors[i]->subtreedone) {
+				visitors[i]->subtreedone(done->dirname, visitors[i]->ctx);
+			}
+		}
+		next = done->next;
+		free(done->dirname);
+		free(done);
+	}
+} // subtreesdone()
+
+int isbelow(const char *path, const char *root)
+{	// is path root itself or somewhere under it?
+	size_t len = strlen(root);
+
+	if (strncmp(path, root, len) != 0) return 0;
+	if (path[len] == '\0' || path[len] == '/') return 1;
+	return (len && root[len-1] == '/');
+} // isbelow()
+
+int scanbelowroots(const char *path)
+{	// does path lie in any of the trees being scanned?
+	int i;
+
+	for (i = 0; i < nroots; i++) {
+		if (isbelow(path, roots[i])) return 1;
+	}
+	return 0;
+} // scanbelowroots()
+
+const char *scanrootof(const char *path)
+{	// the outermost root holding path, NULL if none.
+	const char *best = NULL;
+	int i;
+
+	for (i = 0; i < nroots; i++) {
+		if (!(isbelow(path, roots[i]))) continue;
+		if (!(best) || strlen(roots[i]) < strlen(best)) best = roots[i];
+	}
+	return best;
+} // scanrootof()
+
+void statxtostat(const struct statx *stx, struct stat *sb)
+{	// for callers that keep working in struct stat
+	memset(sb, 0, sizeof(struct stat));
+	sb->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	sb->st_ino = stx->stx_ino;
+	sb->st_mode = stx->stx_mode;
+	sb->st_nlink = stx->stx_nlink;
+	sb->st_uid = stx->stx_uid;
+	sb->st_gid = stx->stx_gid;
+	sb->st_size = stx->stx_size;
+	sb->st_blocks = stx->stx_blocks;
+	sb->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	sb->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	sb->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	sb->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	sb->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	sb->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+} // statxtostat()
@@ -0,0 +1,57 @@
+#ifndef _SCAN_H
+#define _SCAN_H 1
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+/* What enterdir() wants done with a directory. */
+#define SCAN_ALL 0	// visit its entries and go on below it
+#define SCAN_DIRSONLY 1	// no visits here but go on below it
+#define SCAN_SKIP 2	// nothing here or below, for this visitor
+
+#define SCANMAXVISITORS 8
+
+/* One directory entry as handed to a visitor. Entries that are
+ * directories are not visited, the scanner queues them itself. A
+ * symlink is stat'ed through to its target, staterr then tells of a
+ * broken link. When the visitors ask for STATX_NLINK and STATX_INO a
+ * regular file with several names is stat'ed for the first name only,
+ * later names get the same stx and linkseen counts the names before. */
+struct scanentry {
+	int dirfd;	// the directory being read
+	const char *dirpath;
+	const char *name;
+	const char *path;	// dirpath/name
+	unsigned char type;	// DT_REG, DT_LNK etc, never DT_UNKNOWN
+	const struct statx *stx;	// NULL if not stat'ed or it failed
+	int staterr;	// errno of a failed statx(), else 0
+	unsigned linkseen;	// earlier names of this file met, 0 for the first
+};
+
+/* Any callback may be NULL. visit() and leavedir() are called from
+ * several workers at once, as is subtreedone() once path and all below
+ * it have been read, with no lock held.
+ * dirdata is the visitor's own, set in enterdir() and given back for
+ * that directory. */
+struct scanvisitor {
+	unsigned int statmask;	// STATX_ fields wanted, 0 for no stat
+	int (*enterdir)(const char *path, void **dirdata, void *ctx);
+	void (*visit)(const struct scanentry *e, void *dirdata, void *ctx);
+	void (*leavedir)(const char *path, void *dirdata, void *ctx);
+	void (*subtreedone)(const char *path, void *ctx);
+	void *ctx;
+};
+
+void scansetjobs(int jobs);
+void scandevlimit(const char *spec);
+void scanaddvisitor(struct scanvisitor *sv);
+void scanaddroot(const char *path);
+void scanrun(void);
+int scanbelowroots(const char *path);
+const char *scanrootof(const char *path);
+int isbelow(const char *path, const char *root);
+void statxtostat(const struct statx *stx, struct stat *sb);
+
+#endif /* scan.h */
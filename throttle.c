@@ -0,0 +1,193 @@
+/*      throttle.c
+ *
+ *	Copyright 2015 Bob Parker <rlp1938@gmail.com>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *	MA 02110-1301, USA.
+*/
+
+/*
+ * Keeps the walk from getting in the way of whatever else the machine
+ * is doing. Each metadata operation is bracketed by throttlestart() and
+ * throttleend(). throttlestart() may sleep, either to hold the rate to
+ * a fixed cap or, in adaptive mode, because recent operations have been
+ * taking longer than the lowest latency seen so far, which means
+ * somebody else wants the disk. When they stop the delay decays away
+ * and the walk runs flat out again.
+ *
+ * The fixed cap is for the whole process. The adaptive state is kept
+ * per device, by a struct throttle each device's workers share, so a
+ * slow or busy disk doesn't hold back the scan of an idle one.
+*/
+
+#include "throttle.h"
+#include "fileutil.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+#define THROTTLEFACTOR 2.0	// back off above this multiple of baseline
+#define THROTTLEFLOOR 0.0002	// never back off for ops quicker than this
+#define THROTTLESPIKE 8.0	// clip single samples to this multiple of ewma
+#define THROTTLEMAXDELAY 0.1
+#define THROTTLESTEP 0.0001
+#define THROTTLELEARN 300.0	// seconds for baseline to follow quiet ops
+#define THROTTLEFORGET 3600.0	// and to accept loaded ones as normal
+
+static int throttling;
+static double interval;	// seconds between ops with a fixed cap
+static double nextslot;	// when the next op may start with a fixed cap
+static int adapt;
+static pthread_mutex_t throttlelock = PTHREAD_MUTEX_INITIALIZER;
+
+struct throttle {
+	double ewma;	// smoothed op latency
+	double baseline;	// lowest smoothed latency, ie an idle system
+	double delay;	// adaptive sleep before each op
+	pthread_mutex_t lock;
+	double updated;	// when baseline was last moved
+};
+
+static double now(void);
+static void snooze(double secs);
+
+void throttleinit(double maxrate, int adaptive)
+{	/* maxrate is ops per second, 0 for no cap. Whenever throttling is
+	 * on the process also drops to idle io and lowest cpu priority,
+	 * before any workers start so they inherit both. */
+	if (maxrate <= 0 && !(adaptive)) return;
+	throttling = 1;
+	if (maxrate > 0) interval = 1.0 / maxrate;
+	adapt = adaptive;
+#ifdef SYS_ioprio_set
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+				IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == -1) {
+		perror("ioprio_set()");	// not fatal
+	}
+#endif
+	errno = 0;
+	if (setpriority(PRIO_PROCESS, 0, 19) == -1 && errno) {
+		perror("setpriority()");
+	}
+} // throttleinit()
+
+struct throttle *throttlenew(void)
+{	// adaptive state for one device.
+	struct throttle *th = domalloc(sizeof(struct throttle));
+
+	memset(th, 0, sizeof(struct throttle));
+	pthread_mutex_init(&th->lock, NULL);
+	return th;
+} // throttlenew()
+
+void throttlestart(struct throttle *th, struct timespec *started)
+{
+	double wait = 0.0;
+	double t;
+
+	if (!(throttling)) return;
+	if (interval > 0) {
+		// hand out evenly spaced start times across all workers
+		pthread_mutex_lock(&throttlelock);
+		t = now();
+		if (nextslot < t) nextslot = t;
+		wait = nextslot - t;
+		nextslot += interval;
+		pthread_mutex_unlock(&throttlelock);
+	}
+	if (adapt) {
+		pthread_mutex_lock(&th->lock);
+		if (th->delay > wait) wait = th->delay;
+		pthread_mutex_unlock(&th->lock);
+	}
+	if (wait > 0) snooze(wait);
+	clock_gettime(CLOCK_MONOTONIC, started);
+} // throttlestart()
+
+void throttleend(struct throttle *th, const struct timespec *started)
+{	// feed the latency of the op begun at started to the adaptive delay.
+	struct timespec ended;
+	double lat, t;
+
+	if (!(adapt)) return;
+	clock_gettime(CLOCK_MONOTONIC, &ended);
+	lat = (ended.tv_sec - started->tv_sec)
+			+ (ended.tv_nsec - started->tv_nsec) / 1e9;
+	t = ended.tv_sec + ended.tv_nsec / 1e9;
+	pthread_mutex_lock(&th->lock);
+	if (th->ewma == 0.0) {
+		th->ewma = th->baseline = lat;
+		th->updated = t;
+	} else {
+		// one huge directory is not a busy disk
+		if (lat > th->ewma * THROTTLESPIKE) {
+			lat = th->ewma * THROTTLESPIKE;
+		}
+		th->ewma += (lat - th->ewma) / 16;
+		if (th->ewma < th->baseline) {
+			th->baseline = th->ewma;
+		} else {
+			/* creep up, by the clock, so a fast start from a warm
+			 cache is forgotten. While loaded only very slowly, else
+			 steady load is soon taken for an idle disk and the
+			 throttle lets go just when it is wanted. */
+			double span = (th->ewma > th->baseline * THROTTLEFACTOR) ?
+							THROTTLEFORGET : THROTTLELEARN;
+			double step = (t - th->updated) / span;
+			if (step > 1.0) step = 1.0;
+			th->baseline += (th->ewma - th->baseline) * step;
+		}
+		th->updated = t;
+	}
+	// back off gently, get back up to speed quickly.
+	if (th->ewma > THROTTLEFLOOR &&
+			th->ewma > th->baseline * THROTTLEFACTOR) {
+		th->delay += THROTTLESTEP;
+		if (th->delay > THROTTLEMAXDELAY) th->delay = THROTTLEMAXDELAY;
+	} else {
+		th->delay /= 2;
+		if (th->delay < THROTTLESTEP / 100) th->delay = 0.0;
+	}
+	pthread_mutex_unlock(&th->lock);
+} // throttleend()
+
+double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+} // now()
+
+void snooze(double secs)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)secs;
+	ts.tv_nsec = (long)((secs - ts.tv_sec) * 1e9);
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+} // snooze()
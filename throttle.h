@@ -0,0 +1,13 @@
+#ifndef _THROTTLE_H
+#define _THROTTLE_H 1
+
+#include <time.h>
+
+struct throttle;
+
+void throttleinit(double maxrate, int adaptive);
+struct throttle *throttlenew(void);
+void throttlestart(struct throttle *th, struct timespec *started);
+void throttleend(struct throttle *th, const struct timespec *started);
+
+#endif /* throttle.h */
@@ -0,0 +1,147 @@
+/*      timeutil.c
+ *
+ *  Copyright 2015 Bob Parker rlp1938@gmail.com
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+*/
+
+#include "timeutil.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+time_t cutofftimebyage(int age, char aunit)
+{
+    // Calculate the file selection date
+    time_t fileage;
+    struct tm *fatm;
+
+    fileage = time(NULL);
+    fatm = localtime(&fileage);
+    // printf("Time is: %s\n", asctime(fatm));
+    switch (aunit) {
+        case 'Y':
+            fatm->tm_year -= age;
+        break;
+        case 'M':
+        /*
+            tmp = age / 12;
+            fatm->tm_year -= tmp;
+            tmp = age % 12;
+            if (tmp < fatm->tm_mon) {
+                fatm->tm_mon -= tmp;
+            } else {
+                tmp = 12 - tmp;
+                fatm->tm_year--;
+                fatm->tm_mon += tmp;
+            }
+        */
+            fatm->tm_mon -= age;
+        break;
+        case 'D':
+            fatm->tm_mday -= age;
+        break;
+    }
+    return mktime(fatm);
+} // cutofftimebyage()
+
+time_t parsetimestring(const char *timestr)
+{
+   /*
+    * check the string in dts for valid values
+    * and return the time if all ok, else say why and return -1.
+   */
+   char dts[16];
+   struct tm dt;
+
+   // seconds will never be set here, also minutes & hours may not be.
+   dt.tm_sec = 0;
+   dt.tm_min = 0;
+   dt.tm_hour = 0;
+   dt.tm_wday = 0;
+   dt.tm_yday = 0;
+
+   strcpy(dts, timestr);
+   switch(strlen(dts)) {
+        case 12:
+            dt.tm_min = atoi(&dts[10]);
+            if ((dt.tm_min < 0 ) || (dt.tm_min > 59)) {
+                fprintf(stderr, "Illegal value for minutes: %d\n",
+                        dt.tm_min);
+                return (time_t)-1;
+            }
+            dts[10] = '\0';
+        case 10:
+            dt.tm_hour = atoi(&dts[8]);
+            if ((dt.tm_hour < 0 ) || (dt.tm_hour > 23)) {
+                fprintf(stderr, "Illegal value for hours: %d\n",
+                        dt.tm_hour);
+                return (time_t)-1;
+            }
+            dts[8] = '\0';
+        case 8:
+            dt.tm_mday = atoi(&dts[6]);
+            if ((dt.tm_mday < 1 ) || (dt.tm_mday > 31)) { // rough enough for now
+                fprintf(stderr, "Illegal value for days: %d\n",
+                        dt.tm_mday);
+                return (time_t)-1;
+            }
+            dts[6] = '\0';
+            dt.tm_mon = atoi(&dts[4]) - 1;
+            if ((dt.tm_mon < 0 ) || (dt.tm_mon > 11)) {
+                fprintf(stderr, "Illegal value for months: %d\n",
+                        dt.tm_mon+1);
+                return (time_t)-1;
+            }
+            dts[4] = '\0';
+
+            dt.tm_year = atoi(dts) - 1900;
+        break;
+        default:
+        fprintf(stderr, "%s is not formatted correctly\n", dts);
+        return (time_t)-1;
+        break;
+        // now test if our days are valid for the month
+    } // switch()
+
+
+    if (!(validday(dt.tm_year+1900, dt.tm_mon+1, dt.tm_mday))) {
+        fprintf(stderr, "For the year %d, month %d, %d"
+                        " days is invalid\n",
+                        dt.tm_year+1900, dt.tm_mon+1, dt.tm_mday);
+        return (time_t)-1;
+    }
+    return mktime(&dt);
+} // parsetimestring()
+
+int validday(int yy, int mon, int dd)
+{
+    int daysinmonth[13] = {0,31,28,31,30,31,30,31,31,30,31,30,31};
+    if (mon == 2) {
+        daysinmonth[2] += leapyear(yy);
+    }
+    if (dd <= daysinmonth[mon]) return 1;
+    return 0;
+} // validday()
+
+int leapyear(int yy)
+{
+    if (yy % 4 != 0) return 0;
+    if (yy % 400 == 0) return 1;
+    if (yy % 100 == 0) return 0;
+    return 1; // yy % 4 == 0
+} // leapyear()
@@ -0,0 +1,11 @@
+#ifndef _TIMEUTIL_H
+#define _TIMEUTIL_H 1
+
+#include <time.h>
+
+time_t cutofftimebyage(int age, char aunit);
+time_t parsetimestring(const char *dts);
+int validday(int yy, int mon, int dd);
+int leapyear(int yy);
+
+#endif /* timeutil.h */